@@ -3,171 +3,5474 @@
 #include <filesystem>
 #include <vector>
 #include <map>
+#include <list>
+#include <unordered_map>
 #include <sstream>
+#include <string_view>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <future>
+#include <deque>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 namespace fs = std::filesystem;
 
+// Copies of each replicated chunk, and the upper bound of a write quorum
+const int REPLICATION = 3;
+
+// Per-node I/O queue depth limits (see DistributedFS::setIoEngine)
+const unsigned DEFAULT_IO_DEPTH = 32;
+const unsigned MAX_IO_DEPTH = 4096;
+
+// Chunk size limits for uploads (see DistributedFS::setChunkSize)
+const uint64_t MIN_CHUNK_SIZE = 1ULL << 20;
+const uint64_t MAX_CHUNK_SIZE = 1ULL << 30;
+const uint64_t DEFAULT_CHUNK_SIZE = 64ULL << 20;
+
+// Upload source length when it is a stream that is read until it ends
+const uint64_t UNKNOWN_SIZE = UINT64_MAX;
+
+// Files up to this size are packed into the nodes' segment stores
+const uint64_t PACKED_FILE_LIMIT = 64 << 10;
+const uint64_t SEGMENT_SIZE = 256ULL << 20;
+
+// In direct I/O mode, replicas at least this large bypass the page cache
+// (see DistributedFS::setDirectMode); O_DIRECT needs buffers, offsets and
+// lengths aligned to the logical block size
+const uint64_t DIRECT_IO_MIN_SIZE = 8ULL << 20;
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// Human readable byte count, e.g. "64 MiB"
+string formatSize(uint64_t bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    double value = bytes;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    stringstream ss;
+    ss << setprecision(3) << (unit == 0 ? (double)bytes : value) << " " << units[unit];
+    return ss.str();
+}
+
+// Parse sizes such as "4096", "8K", "64M" or "1G"; returns 0 on bad input
+uint64_t parseSize(const string &text) {
+    size_t pos = 0;
+    uint64_t value;
+    try {
+        value = stoull(text, &pos);
+    } catch (const exception &) {
+        return 0;
+    }
+    string suffix = text.substr(pos);
+    if (!suffix.empty() && (suffix.back() == 'B' || suffix.back() == 'b') && suffix.size() > 1)
+        suffix.pop_back();
+    if (suffix.empty()) return value;
+    switch (toupper(suffix[0])) {
+        case 'K': return suffix.size() == 1 ? value << 10 : 0;
+        case 'M': return suffix.size() == 1 ? value << 20 : 0;
+        case 'G': return suffix.size() == 1 ? value << 30 : 0;
+        default: return 0;
+    }
+}
+
+// Run fn(0) .. fn(count - 1) on up to `workers` threads
+void runParallel(size_t count, size_t workers, const function<void(size_t)> &fn) {
+    atomic<size_t> next(0);
+    vector<thread> pool;
+    for (size_t w = 0; w < min(workers, count); w++) {
+        pool.emplace_back([&]() {
+            for (size_t i = next++; i < count; i = next++) fn(i);
+        });
+    }
+    for (auto &worker : pool) worker.join();
+}
+
+// Data paths tried by the transfer engine, cheapest first
+enum class TransferMethod {
+    Reflink,        // FICLONE / FICLONERANGE: shared extents, no data copied
+    CopyFileRange,  // in-kernel copy, no user-space buffers
+    Sendfile,       // in-kernel copy through the page cache
+    IoUring,        // pipelined reads and writes through the node I/O queues
+    Direct,         // the same with O_DIRECT, bypassing the page cache
+    Cached,         // served from the in-memory block cache
+    Buffered        // pread/pwrite through a user-space buffer
+};
+
+const char *transferMethodName(TransferMethod method) {
+    switch (method) {
+        case TransferMethod::Reflink: return "reflink";
+        case TransferMethod::CopyFileRange: return "copy_file_range";
+        case TransferMethod::Sendfile: return "sendfile";
+        case TransferMethod::Direct: return "direct I/O";
+        case TransferMethod::Cached: return "block cache";
+        case TransferMethod::IoUring: return "io_uring";
+        default: return "buffered";
+    }
+}
+
+// Distinct method names in first-used order, e.g. "reflink, buffered"
+string describeMethods(const vector<TransferMethod> &methods) {
+    string result;
+    vector<TransferMethod> seen;
+    for (TransferMethod method : methods) {
+        if (find(seen.begin(), seen.end(), method) != seen.end()) continue;
+        seen.push_back(method);
+        result += (result.empty() ? "" : ", ") + string(transferMethodName(method));
+    }
+    return result;
+}
+
+// Owns a file descriptor and closes it on scope exit
+struct FileDescriptor {
+    int fd;
+
+    FileDescriptor(const fs::path &path, int flags, mode_t mode = 0644) {
+        fd = open(path.c_str(), flags | O_CLOEXEC, mode);
+        if (fd < 0) throw runtime_error("cannot open " + path.string() + ": " + strerror(errno));
+    }
+    ~FileDescriptor() { close(fd); }
+
+    FileDescriptor(const FileDescriptor &) = delete;
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+    uint64_t size() const {
+        struct stat st;
+        if (fstat(fd, &st) != 0) throw runtime_error(string("fstat failed: ") + strerror(errno));
+        return st.st_size;
+    }
+};
+
+// Per-node I/O queue. With io_uring a worker thread owns one ring, batches
+// queued requests into a single io_uring_enter call and keeps up to `depth`
+// operations in flight; otherwise requests run as blocking pread/pwrite.
+class IoQueue {
+private:
+    struct Request {
+        bool write;
+        int fd;
+        char *buffer;
+        size_t length;
+        uint64_t offset;
+        size_t done = 0;  // bytes already transferred (short writes are resubmitted)
+        promise<ssize_t> result;
+    };
+
+    unsigned queueDepth;
+    int ringFd = -1;
+
+    // Shared ring memory (see io_uring_setup(2))
+    void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    io_uring_cqe *cqes;
+
+    deque<Request *> pending;
+    bool stopping = false;
+    mutex mtx;
+    condition_variable cv;
+    thread worker;
+
+    bool setupRing() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, queueDepth, &params);
+        if (ringFd < 0) return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char *sq = (char *)sqRing, *cq = (char *)cqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        queueDepth = min(queueDepth, params.sq_entries);
+
+        // IORING_OP_READ/WRITE came with the probe interface (Linux 5.6); older
+        // kernels reject both, and their nodes use blocking I/O instead
+        vector<char> probeBuffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *probe = (io_uring_probe *)probeBuffer.data();
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        for (unsigned op : {IORING_OP_READ, IORING_OP_WRITE})
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        return true;
+    }
+
+    void releaseRing() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) close(ringFd);
+        ringFd = -1;
+    }
+
+    void queueSqe(Request *request) {
+        unsigned tail = *sqTail;
+        unsigned index = tail & *sqMask;
+        io_uring_sqe &sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = request->fd;
+        sqe.addr = (uint64_t)(request->buffer + request->done);
+        sqe.len = request->length - request->done;
+        sqe.off = request->offset + request->done;
+        sqe.user_data = (uint64_t)request;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    // Take back the SQEs the kernel has not consumed and run them as blocking
+    // pread/pwrite, so their futures still complete
+    void runUnsubmitted() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE), tail = *sqTail;
+        vector<Request *> requests;
+        for (unsigned i = head; i != tail; i++) requests.push_back((Request *)sqes[sqArray[i & *sqMask]].user_data);
+        __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+        for (Request *request : requests) {
+            ssize_t n = blocking(request->write, request->fd, request->buffer + request->done,
+                                 request->length - request->done, request->offset + request->done);
+            request->result.set_value(n < 0 ? n : (ssize_t)(request->done + n));
+            delete request;
+        }
+    }
+
+    void run() {
+        unsigned inFlight = 0;  // consumed by the kernel, not completed yet
+        unsigned queued = 0;    // in the submission ring, not consumed yet
+        while (true) {
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [&] { return stopping || !pending.empty() || inFlight > 0 || queued > 0; });
+                if (stopping && pending.empty() && inFlight == 0 && queued == 0) return;
+
+                // Batch everything that fits into one submission
+                while (!pending.empty() && inFlight + queued < queueDepth) {
+                    queueSqe(pending.front());
+                    pending.pop_front();
+                    queued++;
+                }
+            }
+
+            // The return value is the number of SQEs consumed; a short count
+            // leaves the rest in the ring for the next call
+            int ret = syscall(__NR_io_uring_enter, ringFd, queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            int error = ret < 0 ? errno : 0;
+            unsigned consumed = ret > 0 ? min<unsigned>(ret, queued) : 0;
+            queued -= consumed;
+            inFlight += consumed;
+            // Out of resources with nothing in flight to wait for, or a hard
+            // error: stop waiting for the kernel to take them
+            bool busy = error == EAGAIN || error == EBUSY;
+            bool stuck = inFlight == 0 && (ret == 0 || busy);
+            if (queued > 0 && (stuck || (error != 0 && error != EINTR && !busy))) {
+                runUnsubmitted();
+                queued = 0;
+            }
+
+            unsigned head = *cqHead;
+            while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe &cqe = cqes[head & *cqMask];
+                Request *request = (Request *)cqe.user_data;
+                int res = cqe.res;
+                head++;
+                inFlight--;
+
+                if (res > 0 && request->write && request->done + res < request->length) {
+                    request->done += res;
+                    lock_guard<mutex> lock(mtx);
+                    pending.push_front(request);
+                    continue;
+                }
+                if (res >= 0) request->done += res;
+                request->result.set_value(res < 0 ? res : (ssize_t)request->done);
+                delete request;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+
+public:
+    // Positioned read or write in the calling thread, retried until done
+    static ssize_t blocking(bool write, int fd, char *buffer, size_t length, uint64_t offset) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = write ? pwrite(fd, buffer + done, length - done, offset + done)
+                              : pread(fd, buffer + done, length - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return -errno;
+            if (n == 0) break;
+            done += n;
+        }
+        return done;
+    }
+
+    IoQueue(unsigned depth, bool useUring) : queueDepth(max(1u, depth)) {
+        if (useUring && !setupRing()) releaseRing();
+        if (ringFd >= 0) worker = thread(&IoQueue::run, this);
+    }
+
+    ~IoQueue() {
+        if (ringFd >= 0) {
+            {
+                lock_guard<mutex> lock(mtx);
+                stopping = true;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+        releaseRing();
+    }
+
+    IoQueue(const IoQueue &) = delete;
+    IoQueue &operator=(const IoQueue &) = delete;
+
+    bool usingUring() const { return ringFd >= 0; }
+    unsigned depth() const { return queueDepth; }
+
+    // Queue a positioned read or write; the future yields bytes moved or -errno.
+    // Writes always complete fully unless they fail.
+    future<ssize_t> submit(bool write, int fd, char *buffer, size_t length, uint64_t offset) {
+        if (ringFd < 0) {
+            promise<ssize_t> result;
+            result.set_value(blocking(write, fd, buffer, length, offset));
+            return result.get_future();
+        }
+
+        Request *request = new Request();
+        request->write = write;
+        request->fd = fd;
+        request->buffer = buffer;
+        request->length = length;
+        request->offset = offset;
+        future<ssize_t> result = request->result.get_future();
+        {
+            lock_guard<mutex> lock(mtx);
+            pending.push_back(request);
+        }
+        cv.notify_all();
+        return result;
+    }
+};
+
+// Directory of each node holding replicas still being written
+const char *const STAGING_DIR = ".staging";
+
+// Directory of each node holding its segment store
+const char *const SEGMENTS_DIR = ".segments";
+
+// Directory of each node holding every object, so none can collide with a file
+// name: a file's objects go to files/<escaped name>/, shared content-addressed
+// ones to cas/
+const char *const OBJECTS_DIR = ".objects";
+
+// Object directory (relative to a node) of one file. The name becomes a single
+// component, '%' and '/' escaped, so "a/b" and "a%2Fb" stay apart.
+string fileObjectDir(const string &filename) {
+    string escaped;
+    for (char c : filename) escaped += c == '%' ? "%25" : c == '/' ? "%2F" : string(1, c);
+    return string(OBJECTS_DIR) + "/files/" + escaped + "/";
+}
+
+// Replicas are written under a temporary name in their node's staging
+// directory and only renamed into place once durable, so a crash never leaves
+// a torn object behind; whatever is left in staging is removed at startup
+fs::path temporaryPath(const fs::path &nodeDirectory) {
+    static atomic<uint64_t> counter{0};
+    return nodeDirectory / STAGING_DIR / ("replica" + to_string(++counter));
+}
+
+// Per-node group commit. Writers hand over a finished temporary file and wait;
+// the worker takes everything queued meanwhile as one batch, starts writeback
+// of every file at once, waits for each with fdatasync, renames each file into
+// place and syncs every affected directory once.
+class CommitQueue {
+private:
+    struct Request {
+        int fd;
+        fs::path temp, target;
+        promise<string> result;  // empty, or why the commit failed
+    };
+
+    deque<Request *> pending;
+    bool stopping = false;
+    mutex mtx;
+    condition_variable cv;
+    thread worker;
+    atomic<uint64_t> files{0}, batches{0};
+
+    void run() {
+        while (true) {
+            vector<Request *> batch;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [&] { return stopping || !pending.empty(); });
+                if (pending.empty()) return;
+                batch.assign(pending.begin(), pending.end());
+                pending.clear();
+            }
+            commitBatch(batch);
+            files += batch.size();
+            batches++;
+            for (Request *request : batch) delete request;
+        }
+    }
+
+    void commitBatch(vector<Request *> &batch) {
+        // Queue writeback of the whole batch before waiting on any file, so the
+        // device sees it together. Only these files are flushed (unlike syncfs,
+        // which would also flush other nodes' writes on the same filesystem),
+        // and fdatasync reports each file's own writeback errors.
+        if (batch.size() > 1)
+            for (Request *request : batch) sync_file_range(request->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        vector<string> errors(batch.size());
+        for (size_t i = 0; i < batch.size(); i++)
+            if (fdatasync(batch[i]->fd) != 0)
+                errors[i] = "cannot flush " + batch[i]->temp.string() + ": " + strerror(errno);
+
+        vector<fs::path> directories;
+        for (size_t i = 0; i < batch.size(); i++) {
+            Request &request = *batch[i];
+            if (request.target.empty()) continue;  // flush only
+            if (errors[i].empty() && rename(request.temp.c_str(), request.target.c_str()) != 0)
+                errors[i] = "cannot rename " + request.temp.string() + ": " + strerror(errno);
+            if (!errors[i].empty()) {
+                unlink(request.temp.c_str());
+                continue;
+            }
+            fs::path directory = request.target.parent_path();
+            if (find(directories.begin(), directories.end(), directory) == directories.end())
+                directories.push_back(directory);
+        }
+
+        // The renames themselves become durable with their directories
+        for (auto &directory : directories) {
+            string error;
+            try {
+                FileDescriptor dir(directory.empty() ? "." : directory, O_RDONLY | O_DIRECTORY);
+                if (fsync(dir.fd) != 0) error = "cannot sync " + directory.string() + ": " + strerror(errno);
+            } catch (const exception &e) {
+                error = e.what();
+            }
+            if (error.empty()) continue;
+            for (size_t i = 0; i < batch.size(); i++)
+                if (errors[i].empty() && batch[i]->target.parent_path() == directory) errors[i] = error;
+        }
+        for (size_t i = 0; i < batch.size(); i++) batch[i]->result.set_value(errors[i]);
+    }
+
+public:
+    CommitQueue() { worker = thread(&CommitQueue::run, this); }
+
+    ~CommitQueue() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    CommitQueue(const CommitQueue &) = delete;
+    CommitQueue &operator=(const CommitQueue &) = delete;
+
+    // Make `temp` (written through `fd`, which stays open until this returns)
+    // durable and rename it to `target`; throws if either step fails
+    void commit(int fd, const fs::path &temp, const fs::path &target) {
+        Request *request = new Request();
+        request->fd = fd;
+        request->temp = temp;
+        request->target = target;
+        future<string> result = request->result.get_future();
+        {
+            lock_guard<mutex> lock(mtx);
+            pending.push_back(request);
+        }
+        cv.notify_all();
+        string error = result.get();
+        if (!error.empty()) throw runtime_error(error);
+    }
+
+    // Make what was written through `fd` durable, batched with other commits
+    void flush(int fd, const fs::path &path) { commit(fd, path, fs::path()); }
+
+    uint64_t committedFiles() const { return files; }
+    uint64_t flushBatches() const { return batches; }
+};
+
+// CRC32C (Castagnoli) end-to-end checksums, one per stored block. Works on the
+// raw register: crc32c() adds the usual inversion at both ends.
+const uint32_t CRC32C_POLY = 0x82f63b78;  // reflected
+
+// a * b modulo the CRC polynomial, bit-reflected (x^0 is the top bit)
+uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit; bit >>= 1) {
+        if (a & bit) product ^= b;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(8 * bytes) mod P: advances a register over `bytes` zero bytes
+uint32_t crc32cShiftFactor(uint64_t bytes) {
+    uint32_t result = 1u << 31, base = 1u << 30;  // x^0, x^1
+    for (uint64_t bits = bytes * 8; bits; bits >>= 1) {
+        if (bits & 1) result = crc32cMultiply(result, base);
+        base = crc32cMultiply(base, base);
+    }
+    return result;
+}
+
+uint32_t crc32cScalar(uint32_t crc, const uint8_t *data, size_t length) {
+    static const vector<uint32_t> table = [] {
+        vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (size_t i = 0; i < length; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// The crc32 instruction has a 3-cycle latency but issues every cycle, so three
+// independent lanes run in parallel and are merged with shift factors.
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const uint8_t *data, size_t length) {
+    const size_t lane = 8 << 10;
+    static const uint32_t shift1 = crc32cShiftFactor(lane), shift2 = crc32cShiftFactor(2 * lane);
+
+    for (; length >= 3 * lane; data += 3 * lane, length -= 3 * lane) {
+        uint64_t a = crc, b = 0, c = 0, word;
+        for (size_t i = 0; i < lane; i += 8) {
+            memcpy(&word, data + i, 8);
+            a = _mm_crc32_u64(a, word);
+            memcpy(&word, data + lane + i, 8);
+            b = _mm_crc32_u64(b, word);
+            memcpy(&word, data + 2 * lane + i, 8);
+            c = _mm_crc32_u64(c, word);
+        }
+        crc = crc32cMultiply(shift2, a) ^ crc32cMultiply(shift1, b) ^ c;
+    }
+    uint64_t wide = crc, word;
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = wide;
+    for (; length > 0; data++, length--) crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t length) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32cSse42(~0u, (const uint8_t *)data, length);
+#endif
+    return ~crc32cScalar(~0u, (const uint8_t *)data, length);
+}
+
+// Stored data no longer matches the checksum recorded when it was uploaded
+struct ChecksumError : runtime_error {
+    using runtime_error::runtime_error;
+};
+
+// Bytes covered by each checksum of an uncompressed object
+const size_t CHECKSUM_BLOCK = 1 << 20;
+
+// Check an uncompressed object held in memory against its block checksums
+void verifyBlocks(const char *data, uint64_t length, const vector<uint32_t> &checksums) {
+    if (checksums.size() != (length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK)
+        throw ChecksumError("object has the wrong number of blocks");
+    for (size_t i = 0; i < checksums.size(); i++)
+        if (crc32c(data + i * CHECKSUM_BLOCK, min<uint64_t>(CHECKSUM_BLOCK, length - i * CHECKSUM_BLOCK)) !=
+            checksums[i])
+            throw ChecksumError("checksum mismatch in block " + to_string(i));
+}
+
+// Haystack-style store for a node's small objects. Objects are appended as
+// needles to large segment files and found through an in-memory index, so a
+// write is one sequential append and a read is one pread. The index is rebuilt
+// from the needle headers at startup; deletes append a tombstone. Space of
+// replaced and deleted needles is not reclaimed.
+class SegmentStore {
+private:
+    // Needle layout: header, key, data
+    struct NeedleHeader {
+        uint32_t magic;
+        uint32_t flags;
+        uint32_t keyLength;
+        uint32_t dataLength;
+        uint32_t crc;  // CRC32C of the other header fields and the key
+    };
+    static const uint32_t NEEDLE_MAGIC = 0x4e45444c;
+    static const uint32_t NEEDLE_DELETED = 1;
+
+    struct Location {
+        uint32_t segment;
+        uint64_t offset;  // of the data
+        uint32_t length;
+    };
+
+    fs::path root;
+    unordered_map<string, Location> index;
+    vector<unique_ptr<FileDescriptor>> segments;
+    uint64_t tail = 0;         // end of the last segment
+    uint64_t sealedBytes = 0;  // in the segments before it
+    uint64_t liveBytes = 0;
+    mutable mutex mtx;
+
+    fs::path segmentPath(size_t number) const {
+        stringstream name;
+        name << "segment" << setw(6) << setfill('0') << number << ".dat";
+        return root / name.str();
+    }
+
+    static uint32_t headerCrc(const NeedleHeader &header, const string &key) {
+        string covered((const char *)&header, offsetof(NeedleHeader, crc));
+        covered += key;
+        return crc32c(covered.data(), covered.size());
+    }
+
+    void place(const string &key, const Location &location) {
+        auto existing = index.find(key);
+        if (existing != index.end()) liveBytes -= existing->second.length;
+        index[key] = location;
+        liveBytes += location.length;
+    }
+
+    void forget(const string &key) {
+        auto existing = index.find(key);
+        if (existing == index.end()) return;
+        liveBytes -= existing->second.length;
+        index.erase(existing);
+    }
+
+    // Replay one segment into the index. A torn needle at the end of the last
+    // segment (a crash during an append) is cut off.
+    void scan(uint32_t number, bool last) {
+        int fd = segments[number]->fd;
+        uint64_t size = segments[number]->size(), pos = 0;
+        while (pos < size) {
+            NeedleHeader header;
+            string key;
+            bool valid = size - pos >= sizeof(header) &&
+                         pread(fd, &header, sizeof(header), pos) == (ssize_t)sizeof(header) &&
+                         header.magic == NEEDLE_MAGIC &&
+                         size - pos - sizeof(header) >= (uint64_t)header.keyLength + header.dataLength;
+            if (valid) {
+                key.resize(header.keyLength);
+                valid = pread(fd, &key[0], key.size(), pos + sizeof(header)) == (ssize_t)key.size() &&
+                        headerCrc(header, key) == header.crc;
+            }
+            if (!valid) {
+                if (last && ftruncate(fd, pos) != 0)
+                    throw runtime_error("cannot truncate " + segmentPath(number).string());
+                if (!last) cerr << "Warning: " << segmentPath(number).string() << " is damaged at " << pos << "\n";
+                size = pos;
+                break;
+            }
+            uint64_t data = pos + sizeof(header) + header.keyLength;
+            if (header.flags & NEEDLE_DELETED) forget(key);
+            else place(key, {number, data, header.dataLength});
+            pos = data + header.dataLength;
+        }
+        if (last) tail = size;
+        else sealedBytes += size;
+    }
+
+    // Append one needle to the last segment, starting a new one when it is full
+    Location appendNeedle(const string &key, const char *data, uint32_t length, uint32_t flags) {
+        size_t needle = sizeof(NeedleHeader) + key.size() + length;
+        if (segments.empty() || (tail > 0 && tail + needle > SEGMENT_SIZE)) {
+            fs::create_directories(root);
+            segments.emplace_back(new FileDescriptor(segmentPath(segments.size()), O_RDWR | O_CREAT | O_TRUNC));
+            sealedBytes += tail;
+            tail = 0;
+        }
+        NeedleHeader header = {NEEDLE_MAGIC, flags, (uint32_t)key.size(), length, 0};
+        header.crc = headerCrc(header, key);
+        vector<char> buffer(needle);
+        memcpy(buffer.data(), &header, sizeof(header));
+        memcpy(buffer.data() + sizeof(header), key.data(), key.size());
+        if (length) memcpy(buffer.data() + sizeof(header) + key.size(), data, length);
+
+        int fd = segments.back()->fd;
+        ssize_t written = IoQueue::blocking(true, fd, buffer.data(), needle, tail);
+        if (written != (ssize_t)needle) {
+            // Cut the partial needle off so later appends stay reachable on replay
+            if (ftruncate(fd, tail) != 0)
+                cerr << "Warning: cannot truncate " << segmentPath(segments.size() - 1).string() << "\n";
+            throw runtime_error("cannot append to " + segmentPath(segments.size() - 1).string() + ": " +
+                                strerror(written < 0 ? -written : EIO));
+        }
+        Location location = {(uint32_t)segments.size() - 1, tail + sizeof(header) + key.size(), length};
+        tail += needle;
+        return location;
+    }
+
+public:
+    explicit SegmentStore(const fs::path &root) : root(root) {
+        if (!fs::exists(root)) return;
+        while (fs::exists(segmentPath(segments.size())))
+            segments.emplace_back(new FileDescriptor(segmentPath(segments.size()), O_RDWR));
+        for (size_t i = 0; i < segments.size(); i++) scan(i, i + 1 == segments.size());
+    }
+
+    SegmentStore(const SegmentStore &) = delete;
+    SegmentStore &operator=(const SegmentStore &) = delete;
+
+    // Append `key`, make it durable through the node's group commit, then
+    // publish it; a later append of the same key wins, as on replay
+    void put(const string &key, const char *data, uint32_t length, CommitQueue &commits) {
+        Location location;
+        int fd;
+        {
+            lock_guard<mutex> lock(mtx);
+            location = appendNeedle(key, data, length, 0);
+            fd = segments[location.segment]->fd;
+        }
+        commits.flush(fd, segmentPath(location.segment));
+
+        lock_guard<mutex> lock(mtx);
+        auto existing = index.find(key);
+        if (existing == index.end() || existing->second.segment < location.segment ||
+            (existing->second.segment == location.segment && existing->second.offset < location.offset))
+            place(key, location);
+    }
+
+    // Whole object in one read; throws if the store does not hold it
+    vector<char> get(const string &key) const {
+        Location location;
+        int fd;
+        {
+            lock_guard<mutex> lock(mtx);
+            auto entry = index.find(key);
+            if (entry == index.end()) throw runtime_error("object " + key + " is not in " + root.string());
+            location = entry->second;
+            fd = segments[location.segment]->fd;
+        }
+        vector<char> data(location.length);
+        if (IoQueue::blocking(false, fd, data.data(), data.size(), location.offset) != (ssize_t)data.size())
+            throw runtime_error("cannot read " + key + " from " + segmentPath(location.segment).string());
+        return data;
+    }
+
+    // Segment file and offset holding `key`, for mapping it in place. Segments
+    // are only appended to, so the bytes stay put after the key is removed.
+    bool locate(const string &key, fs::path &path, uint64_t &offset) const {
+        lock_guard<mutex> lock(mtx);
+        auto entry = index.find(key);
+        if (entry == index.end()) return false;
+        path = segmentPath(entry->second.segment);
+        offset = entry->second.offset;
+        return true;
+    }
+
+    bool contains(const string &key) const {
+        lock_guard<mutex> lock(mtx);
+        return index.count(key) > 0;
+    }
+
+    // Drop `key` with a tombstone; not flushed, since replaying a lost
+    // tombstone only brings back an object nothing refers to
+    void remove(const string &key) {
+        lock_guard<mutex> lock(mtx);
+        if (!index.count(key)) return;
+        appendNeedle(key, nullptr, 0, NEEDLE_DELETED);
+        forget(key);
+    }
+
+    size_t objectCount() const {
+        lock_guard<mutex> lock(mtx);
+        return index.size();
+    }
+    size_t segmentCount() const {
+        lock_guard<mutex> lock(mtx);
+        return segments.size();
+    }
+    uint64_t usedBytes() const {
+        lock_guard<mutex> lock(mtx);
+        return sealedBytes + tail;
+    }
+    uint64_t storedBytes() const {
+        lock_guard<mutex> lock(mtx);
+        return liveBytes;
+    }
+};
+
+// Reusable 1 MiB transfer buffers (plus room for a frame header), aligned for
+// O_DIRECT. Pipelines and queued copies take them from here instead of
+// allocating and zeroing fresh memory for every chunk.
+class AlignedBufferPool {
+private:
+    mutex mtx;
+    vector<char *> idle;
+    size_t size;
+    size_t keep;  // idle buffers kept for reuse; the rest are freed
+
+public:
+    // One buffer, returned to the pool when it goes out of scope
+    class Buffer {
+    private:
+        AlignedBufferPool *pool = nullptr;
+        char *memory = nullptr;
+
+    public:
+        Buffer() = default;
+        Buffer(AlignedBufferPool *pool, char *memory) : pool(pool), memory(memory) {}
+        Buffer(Buffer &&other) noexcept : pool(other.pool), memory(other.memory) { other.memory = nullptr; }
+        Buffer &operator=(Buffer &&other) noexcept {
+            swap(pool, other.pool);
+            swap(memory, other.memory);
+            return *this;
+        }
+        ~Buffer() {
+            if (memory) pool->release(memory);
+        }
+
+        char *data() const { return memory; }
+    };
+
+    AlignedBufferPool(size_t size, size_t keep) : size(size), keep(keep) {}
+    ~AlignedBufferPool() {
+        for (char *memory : idle) free(memory);
+    }
+
+    size_t bufferSize() const { return size; }
+
+    Buffer acquire() {
+        {
+            lock_guard<mutex> lock(mtx);
+            if (!idle.empty()) {
+                char *memory = idle.back();
+                idle.pop_back();
+                return Buffer(this, memory);
+            }
+        }
+        char *memory = (char *)aligned_alloc(DIRECT_IO_ALIGNMENT, size);
+        if (!memory) throw bad_alloc();
+        return Buffer(this, memory);
+    }
+
+    void release(char *memory) {
+        lock_guard<mutex> lock(mtx);
+        if (idle.size() < keep) idle.push_back(memory);
+        else free(memory);
+    }
+};
+
+AlignedBufferPool &transferBuffers() {
+    static AlignedBufferPool pool(CHECKSUM_BLOCK + DIRECT_IO_ALIGNMENT, 64);
+    return pool;
+}
+
+// Turn O_DIRECT on or off for an open descriptor; false if the filesystem refuses
+bool setDirectIo(int fd, bool enable) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return false;
+    return fcntl(fd, F_SETFL, enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) == 0;
+}
+
+bool directAligned(uint64_t value) {
+    return value % DIRECT_IO_ALIGNMENT == 0;
+}
+
+// Reserve the extents of a replica before streaming `length` bytes into it at
+// `offset`, so a busy node volume gives it long contiguous runs instead of
+// whatever delayed allocation finds block by block. The file size is left
+// alone (readers and truncation only see what was written). Filesystems
+// without fallocate just skip it.
+void preallocate(int fd, uint64_t offset, uint64_t length) {
+    if (length == 0) return;
+    while (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) != 0 && errno == EINTR) {}
+}
+
+// Tell the kernel a range is read or written front to back (larger readahead,
+// earlier writeback)
+void adviseSequential(int fd, uint64_t offset, uint64_t length) {
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+}
+
+// Copy through I/O queues, keeping up to the queue depth of 1 MiB blocks in flight.
+// With checksums (copying a whole object from offset 0), each block read is
+// checked against its CRC32C before it is written. With `direct`, the whole
+// blocks are copied with both descriptors in O_DIRECT and the odd tail, once
+// they are done, through the page cache; returns whether direct I/O was used.
+bool queuedCopy(int in, uint64_t inOffset, int out, uint64_t outOffset, uint64_t length,
+                IoQueue &readQueue, IoQueue &writeQueue, const vector<uint32_t> *checksums = nullptr,
+                bool direct = false) {
+    struct Block {
+        AlignedBufferPool::Buffer buffer;
+        uint64_t offset;
+        size_t length;
+        bool writing = false;
+        future<ssize_t> pending;
+    };
+    const size_t blockSize = CHECKSUM_BLOCK;
+    size_t window = max(1u, min(readQueue.depth(), writeQueue.depth()));
+    if (direct) {
+        uint64_t head = 0;
+        if (directAligned(inOffset) && directAligned(outOffset) && setDirectIo(in, true) && setDirectIo(out, true))
+            head = length - length % blockSize;
+        if (head > 0) queuedCopy(in, inOffset, out, outOffset, head, readQueue, writeQueue, checksums);
+        setDirectIo(in, false);
+        setDirectIo(out, false);
+        if (head < length) {
+            vector<uint32_t> tailChecksums;
+            if (checksums)
+                tailChecksums.assign(checksums->begin() + min<size_t>(head / blockSize, checksums->size()),
+                                     checksums->end());
+            queuedCopy(in, inOffset + head, out, outOffset + head, length - head, readQueue, writeQueue,
+                       checksums ? &tailChecksums : nullptr);
+        }
+        return head > 0;
+    }
+
+    deque<Block> blocks;
+    uint64_t nextOffset = 0;
+
+    while (nextOffset < length || !blocks.empty()) {
+        // Keep reads in flight ahead of the writes
+        while (blocks.size() < window && nextOffset < length) {
+            blocks.emplace_back();
+            Block &block = blocks.back();
+            block.offset = nextOffset;
+            block.length = min<uint64_t>(blockSize, length - nextOffset);
+            block.buffer = transferBuffers().acquire();
+            block.pending = readQueue.submit(false, in, block.buffer.data(), block.length,
+                                             inOffset + block.offset);
+            nextOffset += block.length;
+        }
+
+        Block &block = blocks.front();
+        ssize_t result = block.pending.get();
+        if (result < 0) {
+            // Let every queued request finish before the buffers go away
+            blocks.pop_front();
+            for (auto &other : blocks) other.pending.wait();
+            throw runtime_error(string(block.writing ? "write" : "read") + " failed: " + strerror(-result));
+        }
+        if (!block.writing) {
+            if ((size_t)result != block.length) {
+                blocks.pop_front();
+                for (auto &other : blocks) other.pending.wait();
+                throw runtime_error("source ended early");
+            }
+            size_t index = block.offset / blockSize;
+            if (checksums && (index >= checksums->size() ||
+                              crc32c(block.buffer.data(), block.length) != (*checksums)[index])) {
+                blocks.pop_front();
+                for (auto &other : blocks) other.pending.wait();
+                throw ChecksumError("checksum mismatch in block " + to_string(index));
+            }
+            block.writing = true;
+            block.pending = writeQueue.submit(true, out, block.buffer.data(), block.length,
+                                              outOffset + block.offset);
+            blocks.push_back(move(block));
+        }
+        blocks.pop_front();
+    }
+    return false;
+}
+
+// Check blocks [from, to) (byte offsets, block-aligned except at the end) of a
+// stored range against its block checksums by reading them back
+void verifyRange(int fd, uint64_t offset, uint64_t length, const vector<uint32_t> &checksums, uint64_t from,
+                 uint64_t to) {
+    AlignedBufferPool::Buffer buffer = transferBuffers().acquire();
+    for (size_t i = from / CHECKSUM_BLOCK; i * CHECKSUM_BLOCK < to; i++) {
+        size_t blockLength = min<uint64_t>(CHECKSUM_BLOCK, length - i * CHECKSUM_BLOCK);
+        for (size_t done = 0; done < blockLength;) {
+            ssize_t n = pread(fd, buffer.data() + done, blockLength - done, offset + i * CHECKSUM_BLOCK + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw runtime_error(string("read failed: ") + strerror(errno));
+            if (n == 0) throw runtime_error("copy ended early");
+            done += n;
+        }
+        if (crc32c(buffer.data(), blockLength) != checksums[i])
+            throw ChecksumError("checksum mismatch in block " + to_string(i));
+    }
+}
+
+// Copy `length` bytes between descriptors, trying reflink, copy_file_range and
+// sendfile, then io_uring when the node queues use it and finally a buffered
+// copy; returns the method that finished the job. With checksums (`out` must be
+// readable) the copy is checked on the destination: a reflink is read back once,
+// which costs a read but no write, and the in-kernel copies move one block at a
+// time and check it while it is still in the page cache. `direct` copies
+// (readQueue required) pass through memory via the queues instead, bypassing
+// the page cache.
+TransferMethod transferRange(int in, uint64_t inOffset, int out, uint64_t outOffset, uint64_t length,
+                             IoQueue *readQueue = nullptr, IoQueue *writeQueue = nullptr,
+                             const vector<uint32_t> *checksums = nullptr, bool direct = false) {
+    if (length == 0) return TransferMethod::Buffered;
+
+    if (!writeQueue) writeQueue = readQueue;
+    auto prepare = [&]() {
+        preallocate(out, outOffset, length);
+        adviseSequential(in, inOffset, length);
+        adviseSequential(out, outOffset, length);
+    };
+    if (direct && readQueue) {
+        prepare();
+        if (queuedCopy(in, inOffset, out, outOffset, length, *readQueue, *writeQueue, checksums, direct))
+            return TransferMethod::Direct;
+        return readQueue->usingUring() ? TransferMethod::IoUring : TransferMethod::Buffered;
+    }
+    if (checksums && checksums->size() != (length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK)
+        throw ChecksumError("object has the wrong number of blocks");
+
+    // Reflink: whole-file clone, or a range clone when the kernel accepts the alignment
+    struct stat st;
+    bool wholeFile = inOffset == 0 && outOffset == 0 && fstat(in, &st) == 0 &&
+                     (uint64_t)st.st_size == length;
+    struct file_clone_range range = {in, inOffset, length, outOffset};
+    if ((wholeFile && ioctl(out, FICLONE, in) == 0) || ioctl(out, FICLONERANGE, &range) == 0) {
+        if (checksums) verifyRange(out, outOffset, length, *checksums, 0, length);
+        return TransferMethod::Reflink;
+    }
+
+    // A real copy follows: lay the target out before the data arrives
+    prepare();
+
+    // Checked copies stop at every block boundary; blocks up to `verified` are good
+    uint64_t done = 0, verified = 0;
+    auto step = [&]() { return checksums ? CHECKSUM_BLOCK - done % CHECKSUM_BLOCK : length - done; };
+    auto copied = [&](uint64_t n) {
+        done += n;
+        uint64_t ready = done == length ? length : done - done % CHECKSUM_BLOCK;
+        if (!checksums || ready <= verified) return;
+        verifyRange(out, outOffset, length, *checksums, verified, ready);
+        verified = ready;
+    };
+
+    // copy_file_range: stays in the kernel, may still share extents on some filesystems
+    loff_t inPos = inOffset, outPos = outOffset;
+    while (done < length) {
+        ssize_t n = copy_file_range(in, &inPos, out, &outPos, min<uint64_t>(step(), length - done), 0);
+        if (n > 0) {
+            copied(n);
+        } else if (n == 0) {
+            throw runtime_error("source ended early");
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    if (done == length) return TransferMethod::CopyFileRange;
+
+    // sendfile: writes at the destination's file position
+    if (lseek(out, outOffset + done, SEEK_SET) >= 0) {
+        off_t inPosition = inOffset + done;
+        while (done < length) {
+            ssize_t n = sendfile(out, in, &inPosition, min<uint64_t>({step(), length - done, 1 << 30}));
+            if (n > 0) {
+                copied(n);
+            } else if (n == 0) {
+                throw runtime_error("source ended early");
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        if (done == length) return TransferMethod::Sendfile;
+    }
+
+    // The rest through the node queues when they use io_uring, checked on the
+    // read side from the first block not yet verified
+    if (checksums) done = verified;
+    if (readQueue && readQueue->usingUring()) {
+        vector<uint32_t> rest;
+        if (checksums) rest.assign(checksums->begin() + done / CHECKSUM_BLOCK, checksums->end());
+        queuedCopy(in, inOffset + done, out, outOffset + done, length - done, *readQueue, *writeQueue,
+                   checksums ? &rest : nullptr);
+        return TransferMethod::IoUring;
+    }
+
+    // Buffered copy always works
+    vector<char> buffer(1 << 20);
+    uint64_t from = done;
+    while (done < length) {
+        ssize_t n = pread(in, buffer.data(), min<uint64_t>(buffer.size(), length - done), inOffset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw runtime_error(string("read failed: ") + strerror(errno));
+        if (n == 0) throw runtime_error("source ended early");
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = pwrite(out, buffer.data() + written, n - written, outOffset + done + written);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) throw runtime_error(string("write failed: ") + strerror(errno));
+            written += w;
+        }
+        done += n;
+    }
+    if (checksums) verifyRange(out, outOffset, length, *checksums, from, length);
+    return TransferMethod::Buffered;
+}
+
+// SHA-256 digest used to address content-defined chunks
+class Sha256 {
+private:
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char block[64];
+    size_t blockLength = 0;
+    uint64_t totalLength = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const unsigned char *data) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+                   (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+public:
+    void update(const char *data, size_t length) {
+        const unsigned char *bytes = (const unsigned char *)data;
+        totalLength += length;
+        while (length > 0) {
+            if (blockLength == 0 && length >= 64) {
+                compress(bytes);
+                bytes += 64;
+                length -= 64;
+                continue;
+            }
+            size_t take = min(length, 64 - blockLength);
+            memcpy(block + blockLength, bytes, take);
+            blockLength += take;
+            bytes += take;
+            length -= take;
+            if (blockLength == 64) {
+                compress(block);
+                blockLength = 0;
+            }
+        }
+    }
+
+    // Finish and return the digest as lowercase hex
+    string hexDigest() {
+        uint64_t bits = totalLength * 8;
+        unsigned char padding[72] = {0x80};
+        size_t padLength = (blockLength < 56) ? 56 - blockLength : 120 - blockLength;
+        for (int i = 0; i < 8; i++) padding[padLength + i] = (unsigned char)(bits >> (56 - 8 * i));
+        update((const char *)padding, padLength + 8);
+
+        stringstream ss;
+        for (uint32_t word : state) ss << hex << setw(8) << setfill('0') << word;
+        return ss.str();
+    }
+};
+
+// FastCDC content-defined chunking parameters
+const size_t CDC_MIN_SIZE = 256 << 10;
+const size_t CDC_AVG_SIZE = 1 << 20;
+const size_t CDC_MAX_SIZE = 4 << 20;
+
+// Gear table for the rolling hash; a fixed seed keeps boundaries stable across runs
+const vector<uint64_t> &gearTable() {
+    static vector<uint64_t> table = [] {
+        vector<uint64_t> values(256);
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        for (auto &value : values) {
+            // splitmix64
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        return values;
+    }();
+    return table;
+}
+
+// Length of the next content-defined chunk at the start of data[0, length).
+// Normalized chunking: a stricter mask before the average size, a looser one after.
+size_t findCdcBoundary(const char *data, size_t length) {
+    const uint64_t maskStrict = ((1ULL << 22) - 1) << 42;  // 22 bits: cuts rarely
+    const uint64_t maskLoose = ((1ULL << 18) - 1) << 46;   // 18 bits: cuts often
+    const vector<uint64_t> &gear = gearTable();
+
+    if (length <= CDC_MIN_SIZE) return length;
+    size_t limit = min(length, CDC_MAX_SIZE);
+    size_t normal = min(limit, CDC_AVG_SIZE);
+
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[(unsigned char)data[i]];
+        if (!(hash & maskStrict)) return i;
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + gear[(unsigned char)data[i]];
+        if (!(hash & maskLoose)) return i;
+    }
+    return limit;
+}
+
+// Block size of the stored version's signatures for delta re-uploads
+const size_t DELTA_BLOCK = 16 << 10;
+
+// rsync's weak checksum over a fixed window, updated in O(1) per byte slid
+struct RollingChecksum {
+    uint32_t a = 0, b = 0;
+    uint32_t window = 0;
+
+    void reset(const uint8_t *data, size_t length) {
+        a = b = 0;
+        window = length;
+        for (size_t i = 0; i < length; i++) {
+            a += data[i];
+            b += (uint32_t)(length - i) * data[i];
+        }
+    }
+
+    // Drop `out` from the front of the window and append `in`
+    void roll(uint8_t out, uint8_t in) {
+        a += in - out;
+        b += a - window * out;
+    }
+
+    uint32_t digest() const { return (a & 0xffff) | (b << 16); }
+};
+
+// GF(2^8) arithmetic for Reed-Solomon coding (polynomial x^8 + x^4 + x^3 + x^2 + 1)
+struct GaloisField {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    GaloisField() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        exp[510] = exp[511] = 0;
+        log[0] = 0;
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const { return (a && b) ? exp[log[a] + log[b]] : 0; }
+    uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+};
+
+const GaloisField &galoisField() {
+    static const GaloisField field;
+    return field;
+}
+
+// Region kernels: dst[i] ^= c * src[i]. The SIMD versions look up the products of
+// the low and high nibble of each byte in two 16-entry tables with PSHUFB.
+void gfMulAddScalar(uint8_t c, const uint8_t *src, uint8_t *dst, size_t length) {
+    const GaloisField &gf = galoisField();
+    uint8_t table[256];
+    for (int x = 0; x < 256; x++) table[x] = gf.mul(c, x);
+    for (size_t i = 0; i < length; i++) dst[i] ^= table[src[i]];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void gfNibbleTables(uint8_t c, uint8_t *low, uint8_t *high) {
+    const GaloisField &gf = galoisField();
+    for (int x = 0; x < 16; x++) {
+        low[x] = gf.mul(c, x);
+        high[x] = gf.mul(c, x << 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+void gfMulAddSsse3(uint8_t c, const uint8_t *src, uint8_t *dst, size_t length) {
+    alignas(16) uint8_t low[16], high[16];
+    gfNibbleTables(c, low, high);
+    __m128i lowTable = _mm_load_si128((const __m128i *)low);
+    __m128i highTable = _mm_load_si128((const __m128i *)high);
+    __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i product = _mm_xor_si128(
+            _mm_shuffle_epi8(lowTable, _mm_and_si128(in, mask)),
+            _mm_shuffle_epi8(highTable, _mm_and_si128(_mm_srli_epi64(in, 4), mask)));
+        __m128i out = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(out, product));
+    }
+    if (i < length) gfMulAddScalar(c, src + i, dst + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void gfMulAddAvx2(uint8_t c, const uint8_t *src, uint8_t *dst, size_t length) {
+    alignas(16) uint8_t low[16], high[16];
+    gfNibbleTables(c, low, high);
+    __m256i lowTable = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)low));
+    __m256i highTable = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)high));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i product = _mm256_xor_si256(
+            _mm256_shuffle_epi8(lowTable, _mm256_and_si256(in, mask)),
+            _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi64(in, 4), mask)));
+        __m256i out = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(out, product));
+    }
+    if (i < length) gfMulAddSsse3(c, src + i, dst + i, length - i);
+}
+#endif
+
+// Widest kernel the CPU supports, picked once at startup
+struct GfKernel {
+    void (*mulAdd)(uint8_t, const uint8_t *, uint8_t *, size_t) = gfMulAddScalar;
+    const char *name = "scalar";
+
+    GfKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2")) {
+            mulAdd = gfMulAddAvx2;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("ssse3")) {
+            mulAdd = gfMulAddSsse3;
+            name = "ssse3";
+        }
+#endif
+    }
+};
+
+const GfKernel &gfKernel() {
+    static const GfKernel kernel;
+    return kernel;
+}
+
+// Systematic Reed-Solomon code: k data shards and m parity shards, any k of which
+// rebuild the rest. The parity rows form a Cauchy matrix, so every k x k
+// submatrix of the generator [I; C] is invertible.
+class ReedSolomon {
+private:
+    int k, m;
+    vector<vector<uint8_t>> parityRows;  // m x k
+
+    vector<uint8_t> generatorRow(int shard) const {
+        if (shard >= k) return parityRows[shard - k];
+        vector<uint8_t> row(k, 0);
+        row[shard] = 1;
+        return row;
+    }
+
+    // out = sum of rows[j] * in[j] over the k inputs
+    void combine(const vector<uint8_t> &row, const vector<const uint8_t *> &in, uint8_t *out,
+                 size_t length) const {
+        memset(out, 0, length);
+        for (int j = 0; j < k; j++)
+            if (row[j]) gfKernel().mulAdd(row[j], in[j], out, length);
+    }
+
+public:
+    ReedSolomon(int dataShards, int parityShards) : k(dataShards), m(parityShards) {
+        const GaloisField &gf = galoisField();
+        parityRows.assign(m, vector<uint8_t>(k));
+        for (int i = 0; i < m; i++)
+            for (int j = 0; j < k; j++)
+                parityRows[i][j] = gf.inv((k + i) ^ j);
+    }
+
+    // Fill the m parity shards from the k data shards
+    void encode(const vector<const uint8_t *> &data, const vector<uint8_t *> &parity,
+                size_t length) const {
+        for (int i = 0; i < m; i++) combine(parityRows[i], data, parity[i], length);
+    }
+
+    // Rebuild every shard not marked present, in place; throws if fewer than k remain
+    void reconstruct(const vector<uint8_t *> &shards, const vector<bool> &present,
+                     size_t length) const {
+        const GaloisField &gf = galoisField();
+        vector<int> chosen;
+        for (int i = 0; i < k + m && (int)chosen.size() < k; i++)
+            if (present[i]) chosen.push_back(i);
+        if ((int)chosen.size() < k)
+            throw runtime_error("only " + to_string(chosen.size()) + " of " + to_string(k) +
+                                " required shards are available");
+
+        // Invert the generator rows of the surviving shards (Gauss-Jordan)
+        vector<vector<uint8_t>> matrix(k), inverse(k, vector<uint8_t>(k, 0));
+        for (int r = 0; r < k; r++) {
+            matrix[r] = generatorRow(chosen[r]);
+            inverse[r][r] = 1;
+        }
+        for (int col = 0; col < k; col++) {
+            int pivot = col;
+            while (matrix[pivot][col] == 0) pivot++;
+            swap(matrix[pivot], matrix[col]);
+            swap(inverse[pivot], inverse[col]);
+            uint8_t scale = gf.inv(matrix[col][col]);
+            for (int j = 0; j < k; j++) {
+                matrix[col][j] = gf.mul(matrix[col][j], scale);
+                inverse[col][j] = gf.mul(inverse[col][j], scale);
+            }
+            for (int r = 0; r < k; r++) {
+                uint8_t factor = matrix[r][col];
+                if (r == col || factor == 0) continue;
+                for (int j = 0; j < k; j++) {
+                    matrix[r][j] ^= gf.mul(factor, matrix[col][j]);
+                    inverse[r][j] ^= gf.mul(factor, inverse[col][j]);
+                }
+            }
+        }
+
+        vector<const uint8_t *> survivors;
+        for (int i : chosen) survivors.push_back(shards[i]);
+        for (int i = 0; i < k; i++)
+            if (!present[i]) combine(inverse[i], survivors, shards[i], length);
+
+        vector<const uint8_t *> data(shards.begin(), shards.begin() + k);
+        for (int i = 0; i < m; i++)
+            if (!present[k + i]) combine(parityRows[i], data, shards[k + i], length);
+    }
+};
+
+// LZ4 block format, used to compress chunk data once at ingest. Level 1 takes the
+// first hash hit and skips ahead over incompressible data; higher levels walk a
+// hash chain of 2^(level-1) candidates for longer matches (up to level 9).
+const int LZ4_MIN_MATCH = 4;
+const size_t LZ4_LAST_LITERALS = 5;   // a block always ends with literals
+const size_t LZ4_MATCH_LIMIT = 12;    // no match starts this close to the end
+const size_t LZ4_MAX_OFFSET = 65535;
+const int LZ4_HASH_BITS = 16;
+const int LZ4_MAX_LEVEL = 9;
+
+inline uint32_t lz4Read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+inline uint32_t lz4Hash(uint32_t sequence) { return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS); }
+
+// Variable-length count after a 15 in the token nibble; false if it does not fit
+inline bool lz4PutLength(uint8_t *dst, size_t &out, size_t capacity, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (out >= capacity) return false;
+        dst[out++] = 255;
+    }
+    if (out >= capacity) return false;
+    dst[out++] = length;
+    return true;
+}
+
+// Compress into dst; 0 if the result would not fit in `capacity`
+size_t lz4Compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity, int level) {
+    vector<int32_t> head(1 << LZ4_HASH_BITS, -1);
+    vector<int32_t> chain(level > 1 ? length : 0);
+    int depth = 1 << (min(level, LZ4_MAX_LEVEL) - 1);
+    size_t out = 0, anchor = 0, ip = 0;
+
+    auto emit = [&](size_t literals, size_t offset, size_t matchLength) {
+        if (out + 1 + literals > capacity) return false;
+        size_t tokenAt = out++;
+        uint8_t token = min<size_t>(literals, 15) << 4;
+        if (literals >= 15 && !lz4PutLength(dst, out, capacity, literals - 15)) return false;
+        if (out + literals > capacity) return false;
+        memcpy(dst + out, src + anchor, literals);
+        out += literals;
+        if (matchLength) {
+            token |= min<size_t>(matchLength - LZ4_MIN_MATCH, 15);
+            if (out + 2 > capacity) return false;
+            dst[out++] = offset & 0xff;
+            dst[out++] = offset >> 8;
+            if (matchLength - LZ4_MIN_MATCH >= 15 &&
+                !lz4PutLength(dst, out, capacity, matchLength - LZ4_MIN_MATCH - 15))
+                return false;
+        }
+        dst[tokenAt] = token;
+        return true;
+    };
+    auto insert = [&](size_t pos) {
+        uint32_t h = lz4Hash(lz4Read32(src + pos));
+        if (level > 1) chain[pos] = head[h];
+        head[h] = pos;
+    };
+
+    if (length > LZ4_MATCH_LIMIT) {
+        size_t matchStartLimit = length - LZ4_MATCH_LIMIT;
+        size_t matchEndLimit = length - LZ4_LAST_LITERALS;
+        while (ip <= matchStartLimit) {
+            uint32_t sequence = lz4Read32(src + ip);
+            size_t bestLength = 0, bestPos = 0;
+            int attempts = depth;
+            for (int32_t candidate = head[lz4Hash(sequence)];
+                 candidate >= 0 && ip - candidate <= LZ4_MAX_OFFSET && attempts-- > 0;
+                 candidate = (level > 1) ? chain[candidate] : -1) {
+                if (lz4Read32(src + candidate) != sequence) continue;
+                size_t matchLength = LZ4_MIN_MATCH;
+                while (ip + matchLength < matchEndLimit && src[candidate + matchLength] == src[ip + matchLength])
+                    matchLength++;
+                if (matchLength > bestLength) {
+                    bestLength = matchLength;
+                    bestPos = candidate;
+                }
+            }
+            insert(ip);
+
+            if (bestLength < (size_t)LZ4_MIN_MATCH) {
+                // Level 1 speeds up the longer it goes without a match
+                ip += (level > 1) ? 1 : 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            if (!emit(ip - anchor, ip - bestPos, bestLength)) return 0;
+            if (level > 1)
+                for (size_t pos = ip + 1; pos < ip + bestLength && pos <= matchStartLimit; pos++) insert(pos);
+            ip += bestLength;
+            anchor = ip;
+        }
+    }
+    if (!emit(length - anchor, 0, 0)) return 0;
+    return out;
+}
+
+// Decompress exactly `rawLength` bytes; false on malformed input
+bool lz4Decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t rawLength) {
+    size_t ip = 0, op = 0;
+    auto readLength = [&](size_t &value) {
+        uint8_t byte;
+        do {
+            if (ip >= length) return false;
+            byte = src[ip++];
+            value += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (ip < length) {
+        uint8_t token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(literals)) return false;
+        if (literals > length - ip || literals > rawLength - op) return false;
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == length) break;  // the last sequence has no match
+
+        if (length - ip < 2) return false;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(matchLength)) return false;
+        matchLength += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > op || matchLength > rawLength - op) return false;
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < matchLength; i++, op++) dst[op] = dst[op - offset];
+    }
+    return op == rawLength;
+}
+
+// Compressed objects are a sequence of frames, one per pipeline block:
+// uint32 stored length (FRAME_RAW set: kept uncompressed), uint32 raw length, payload
+const size_t FRAME_HEADER = 8;
+const uint32_t FRAME_RAW = 1u << 31;
+
+// Encode one block as a frame into `out` (room for FRAME_HEADER + length bytes).
+// The block stays raw unless compression saves at least 1/32 of it.
+size_t encodeFrame(const char *data, uint32_t length, char *out, int level, bool tryCompress) {
+    uint32_t stored = 0;
+    if (tryCompress)
+        stored = lz4Compress((const uint8_t *)data, length, (uint8_t *)out + FRAME_HEADER,
+                             length - length / 32, level);
+    uint32_t header[2] = {stored, length};
+    if (stored == 0) {
+        memcpy(out + FRAME_HEADER, data, length);
+        stored = length;
+        header[0] = length | FRAME_RAW;
+    }
+    memcpy(out, header, FRAME_HEADER);
+    return FRAME_HEADER + stored;
+}
+
+// Decode the frame at data[pos] and advance past it. Returns the raw bytes,
+// pointing into data or into `scratch`; throws on a corrupt frame.
+const char *decodeFrame(const vector<char> &data, size_t &pos, vector<char> &scratch,
+                        uint32_t &rawLength) {
+    uint32_t header[2];
+    if (data.size() - pos < FRAME_HEADER) throw runtime_error("truncated frame header");
+    memcpy(header, data.data() + pos, FRAME_HEADER);
+    uint32_t stored = header[0] & ~FRAME_RAW;
+    rawLength = header[1];
+    pos += FRAME_HEADER;
+    if (data.size() - pos < stored) throw runtime_error("truncated frame");
+
+    const char *payload = data.data() + pos;
+    pos += stored;
+    if (header[0] & FRAME_RAW) {
+        if (stored != rawLength) throw runtime_error("bad raw frame length");
+        return payload;
+    }
+    scratch.resize(rawLength);
+    if (!lz4Decompress((const uint8_t *)payload, stored, (uint8_t *)scratch.data(), rawLength))
+        throw runtime_error("corrupt compressed frame");
+    return scratch.data();
+}
+
+// Check every frame of a compressed object against its CRC32C before decoding
+void verifyFrames(const vector<char> &data, const vector<uint32_t> &checksums) {
+    size_t frame = 0;
+    for (size_t pos = 0; pos < data.size(); frame++) {
+        uint32_t stored;
+        if (data.size() - pos < FRAME_HEADER) throw runtime_error("truncated frame header");
+        memcpy(&stored, data.data() + pos, sizeof(stored));
+        size_t length = FRAME_HEADER + (stored & ~FRAME_RAW);
+        if (data.size() - pos < length || frame >= checksums.size() ||
+            crc32c(data.data() + pos, length) != checksums[frame])
+            throw ChecksumError("checksum mismatch in frame " + to_string(frame));
+        pos += length;
+    }
+    if (frame != checksums.size()) throw ChecksumError("object is missing frames");
+}
+
+// Common signatures of formats that are compressed already (gzip, zstd, xz,
+// bzip2, zip, 7z, LZ4 frame, PNG, JPEG, MP4)
+bool looksCompressed(const char *data, size_t length) {
+    static const vector<string> signatures = {
+        "\x1f\x8b", "\x28\xb5\x2f\xfd", "\xfd\x37\x7a\x58\x5a", "BZh", "PK\x03\x04",
+        string("7z\xbc\xaf\x27\x1c", 6), "\x04\x22\x4d\x18", "\x89PNG", "\xff\xd8\xff"};
+    for (auto &signature : signatures)
+        if (length >= signature.size() && memcmp(data, signature.data(), signature.size()) == 0)
+            return true;
+    return length >= 8 && memcmp(data + 4, "ftyp", 4) == 0;
+}
+
+// Parse a compression choice such as "lz4", "lz4:9" or "none"
+bool parseCompression(const string &spec, string &codec, int &level) {
+    size_t colon = spec.find(':');
+    codec = spec.substr(0, colon);
+    level = (colon == string::npos) ? 1 : atoi(spec.c_str() + colon + 1);
+    if (codec == "none") return colon == string::npos;
+    return codec == "lz4" && level >= 1 && level <= LZ4_MAX_LEVEL;
+}
+
+// Read-only istream over an in-memory buffer, without copying it
+struct MemoryBuffer : streambuf {
+    MemoryBuffer(const char *data, size_t length) {
+        char *begin = const_cast<char *>(data);
+        setg(begin, begin, begin + length);
+    }
+};
+
+// Ring of reusable buffers: one reader fills slots, every consumer writes each slot.
+// In chained mode consumer i only sees a slot after consumer i-1 has released it,
+// which models chain replication where each node forwards blocks to the next.
+class BufferRing {
+private:
+    struct Slot {
+        AlignedBufferPool::Buffer data;
+        size_t length = 0;
+        int remaining = 0;  // consumers that still have to process this slot
+    };
+
+    vector<Slot> slots;
+    vector<size_t> takenSeq;     // next slot sequence each consumer will take
+    vector<size_t> releasedSeq;  // slots each consumer has finished with
+    vector<bool> detached;
+    vector<bool> demotedFlags;
+    size_t writeSeq = 0;      // slots published so far
+    int activeConsumers;
+    int quorum;               // consumers that must keep up with the reader
+    bool chained;
+    bool finished = false;
+
+    mutex mtx;
+    condition_variable cv;
+
+public:
+    BufferRing(size_t slotCount, size_t slotSize, int consumers, bool chained = false,
+               int quorum = 0)
+        : slots(slotCount), takenSeq(consumers, 0), releasedSeq(consumers, 0),
+          detached(consumers, false), demotedFlags(consumers, false), activeConsumers(consumers),
+          quorum(quorum ? quorum : consumers), chained(chained) {
+        if (slotSize > transferBuffers().bufferSize()) throw logic_error("pipeline slot too large");
+        for (auto &slot : slots) slot.data = transferBuffers().acquire();
+    }
+
+private:
+    // Slots this consumer may see: published ones, or in chained mode the ones
+    // its nearest live predecessor has already forwarded
+    size_t available(int consumer) const {
+        if (chained) {
+            for (int prev = consumer - 1; prev >= 0; prev--)
+                if (!detached[prev]) return releasedSeq[prev];
+        }
+        return writeSeq;
+    }
+
+    bool ended(int consumer) const {
+        return detached[consumer] || (finished && takenSeq[consumer] == writeSeq);
+    }
+
+    void take(int consumer, const char *&data, size_t &length) {
+        Slot &slot = slots[takenSeq[consumer] % slots.size()];
+        data = slot.data.data();
+        length = slot.length;
+        takenSeq[consumer]++;
+    }
+
+    void detachLocked(int consumer) {
+        for (size_t seq = releasedSeq[consumer]; seq < writeSeq; seq++)
+            slots[seq % slots.size()].remaining--;
+        detached[consumer] = true;
+        activeConsumers--;
+        cv.notify_all();
+    }
+
+    // The reader needs the slot published as `seq`. Once a quorum of consumers is
+    // done with it, drop the ones still holding it back instead of waiting on them.
+    // Consumers that are only starved by a slow chain predecessor are left alone.
+    bool demoteLaggards(size_t seq) {
+        int ahead = 0;
+        for (size_t c = 0; c < detached.size(); c++)
+            if (!detached[c] && releasedSeq[c] > seq) ahead++;
+        if (ahead < quorum) return false;
+        for (size_t c = 0; c < detached.size(); c++) {
+            if (detached[c] || releasedSeq[c] > seq) continue;
+            if (takenSeq[c] == releasedSeq[c] && takenSeq[c] == available(c)) continue;
+            demotedFlags[c] = true;
+            detachLocked(c);
+        }
+        return slots[seq % slots.size()].remaining == 0;
+    }
+
+public:
+
+    // Reader: wait until the next slot is free; nullptr once every consumer left
+    char *acquire() {
+        unique_lock<mutex> lock(mtx);
+        Slot &slot = slots[writeSeq % slots.size()];
+        cv.wait(lock, [&] {
+            if (slot.remaining == 0 || activeConsumers == 0) return true;
+            return quorum < activeConsumers && demoteLaggards(writeSeq - slots.size());
+        });
+        if (activeConsumers == 0) return nullptr;
+        return slot.data.data();
+    }
+
+    // Reader: hand the acquired slot to all consumers (length 0 marks end of stream)
+    void publish(size_t length) {
+        lock_guard<mutex> lock(mtx);
+        if (length == 0) {
+            finished = true;
+        } else {
+            Slot &slot = slots[writeSeq % slots.size()];
+            slot.length = length;
+            slot.remaining = activeConsumers;
+            writeSeq++;
+        }
+        cv.notify_all();
+    }
+
+    // Consumer: wait for the next filled slot; false at end of stream.
+    // A consumer may hold several slots; only block here while holding none,
+    // otherwise the reader can wait on a slot this consumer never releases.
+    bool next(int consumer, const char *&data, size_t &length) {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&] {
+            return ended(consumer) || takenSeq[consumer] < available(consumer);
+        });
+        if (detached[consumer] || takenSeq[consumer] == writeSeq) return false;
+        take(consumer, data, length);
+        return true;
+    }
+
+    // Consumer: take the next slot if one is ready; `ended` reports end of stream
+    bool tryNext(int consumer, const char *&data, size_t &length, bool &ended) {
+        lock_guard<mutex> lock(mtx);
+        ended = this->ended(consumer);
+        if (ended || takenSeq[consumer] >= available(consumer)) return false;
+        take(consumer, data, length);
+        return true;
+    }
+
+    // Consumer: done with its oldest taken slot; false if it was demoted meanwhile,
+    // in which case the slot may already hold newer data
+    bool release(int consumer) {
+        lock_guard<mutex> lock(mtx);
+        if (detached[consumer]) return false;
+        slots[releasedSeq[consumer] % slots.size()].remaining--;
+        releasedSeq[consumer]++;
+        cv.notify_all();
+        return true;
+    }
+
+    // Whether the consumer was dropped for falling behind (see quorum)
+    bool demoted(int consumer) {
+        lock_guard<mutex> lock(mtx);
+        return demotedFlags[consumer];
+    }
+
+    // Consumer gives up (e.g. write error); the reader stops waiting for it.
+    // The consumer must no longer touch slots it has taken.
+    void detach(int consumer) {
+        lock_guard<mutex> lock(mtx);
+        if (!detached[consumer]) detachLocked(consumer);
+    }
+};
+
+// How replicas receive data during an upload
+enum class ReplicationMode {
+    Star,   // client streams every block to all replicas
+    Chain   // client streams to the first replica, each replica forwards to the next
+};
+
+// How an upload is cut into chunks
+enum class ChunkingMode {
+    Fixed,          // fixed-size chunks named after the file
+    ContentDefined  // FastCDC chunks addressed by SHA-256 and shared between files
+};
+
+// Per-upload settings chosen on the command line
+struct UploadOptions {
+    ReplicationMode mode = ReplicationMode::Star;
+    ChunkingMode chunking = ChunkingMode::Fixed;
+    bool zeroCopy = false;    // replicas copied file-to-file by the transfer engine
+    uint64_t chunkSize = 0;   // 0 = use the DFS default
+    int quorum = 0;           // replicas to wait for; 0 = use the DFS write quorum
+    string source;            // read the data from here instead of the file named like the upload
+                              // (FIFO, device, "-" = stdin; a regular file for zero-copy)
+    int dataShards = 0;       // Reed-Solomon k + m instead of replicas; 0 = replicate
+    int parityShards = 0;
+    string compression;       // "lz4", "none", or "" = follow the per-file rules
+    int compressionLevel = 1;
+    bool delta = true;        // a re-upload sends only what the stored version lacks
+};
+
+// Compression for uploads whose filename matches `pattern` (shell glob)
+struct CompressionRule {
+    string pattern;
+    string codec;
+    int level;
+};
+
+// Chooses which replica serves a read. Per node it keeps an EWMA of the time a
+// read takes per MiB (reads under 1 MiB count as 1 MiB) and the reads in
+// flight, and sends each read to the node with the lowest expected cost,
+// latency x (in flight + 1). Nodes without a sample yet are tried first, and
+// a failed read doubles the node's latency so it is avoided for a while.
+class ReplicaSelector {
+private:
+    struct NodeStats {
+        double latency = 0;  // EWMA, milliseconds per MiB; 0 = no sample yet
+        int inFlight = 0;
+        uint64_t reads = 0;
+        uint64_t failures = 0;
+    };
+
+    static constexpr double WEIGHT = 0.2;  // weight of a new sample
+    static const size_t RECENT_READS = 256;  // window for latency percentiles
+    static const size_t MIN_SAMPLES = 16;
+
+    mutable mutex mtx;
+    vector<NodeStats> stats;
+    vector<double> recent;  // latest samples over all nodes, ms per MiB (ring)
+    size_t nextSample = 0;
+
+public:
+    explicit ReplicaSelector(size_t nodeCount) : stats(nodeCount) {}
+
+    // Take the best of `candidates` (node IDs) and count a read in flight on it;
+    // ties go to the node with fewer reads so far
+    int pick(const vector<int> &candidates) {
+        lock_guard<mutex> lock(mtx);
+        int best = -1;
+        double bestCost = 0;
+        for (int id : candidates) {
+            NodeStats &node = stats[id - 1];
+            double cost = node.latency * (node.inFlight + 1);
+            if (best == -1 || cost < bestCost ||
+                (cost == bestCost && node.reads + node.inFlight < stats[best - 1].reads + stats[best - 1].inFlight)) {
+                best = id;
+                bestCost = cost;
+            }
+        }
+        if (best != -1) stats[best - 1].inFlight++;
+        return best;
+    }
+
+    // A read picked from `nodeId` finished: `bytes` read in `seconds`, or failed
+    void finish(int nodeId, uint64_t bytes, double seconds, bool failed = false) {
+        lock_guard<mutex> lock(mtx);
+        NodeStats &node = stats[nodeId - 1];
+        node.inFlight--;
+        node.reads++;
+        if (failed) {
+            node.failures++;
+            node.latency = max(node.latency * 2, 1.0);
+            return;
+        }
+        double sample = seconds * 1000 / max(bytes / double(1 << 20), 1.0);
+        node.latency = node.latency == 0 ? sample : (1 - WEIGHT) * node.latency + WEIGHT * sample;
+        if (recent.size() < RECENT_READS) recent.push_back(sample);
+        else recent[nextSample++ % RECENT_READS] = sample;
+    }
+
+    // The `quantile` (e.g. 0.95) of recent read latencies in ms per MiB; 0 until
+    // there are enough samples
+    double percentile(double quantile) const {
+        lock_guard<mutex> lock(mtx);
+        if (recent.size() < MIN_SAMPLES) return 0;
+        vector<double> sorted = recent;
+        size_t rank = min(sorted.size() - 1, (size_t)(quantile * sorted.size()));
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+    // "12 reads, 3.2 ms/MiB" for the node status, or "" before the first read
+    string describe(int nodeId) const {
+        lock_guard<mutex> lock(mtx);
+        const NodeStats &node = stats[nodeId - 1];
+        if (node.reads == 0) return "";
+        stringstream ss;
+        ss << node.reads << " reads, " << fixed << setprecision(2) << node.latency << " ms/MiB";
+        if (node.failures > 0) ss << ", " << node.failures << " failed";
+        return ss.str();
+    }
+};
+
+// One read raced across replicas by DistributedFS::hedgedRead
+struct HedgedRead {
+    mutex mtx;
+    condition_variable cv;
+    atomic<bool> cancelled{false};  // set once a read won; the others stop
+    int winner = -1;                // node whose answer is used
+    int running = 0;                // reads not finished yet
+    vector<char> data;              // the winner's verified bytes
+    string error;                   // last failure, for when every read fails
+};
+
+// Bounded read cache of verified file data, split into shards with their own
+// lock. Entries are 1 MiB blocks of plain chunks or the stored bytes of packed
+// and compressed chunks, keyed by file, file generation, chunk and block; a new
+// version or a delete bumps the file's generation and drops its entries.
+//
+// Each shard runs ARC weighted by bytes: T1 holds data seen once recently, T2
+// data seen at least twice, and the ghost lists B1/B2 remember keys recently
+// evicted from each. A hit in a ghost list moves the T1 target `p` towards the
+// list that would have kept it, so one large scan cannot flush the hot set.
+class BlockCache {
+public:
+    using Data = shared_ptr<const vector<char>>;
+    static const uint64_t WHOLE = UINT64_MAX;  // block index of a whole stored chunk
+
+private:
+    enum ListId { T1, T2, B1, B2 };
+    struct Entry {
+        string key;
+        uint64_t size;
+        Data data;  // null in the ghost lists
+    };
+    struct Location {
+        ListId queue;
+        list<Entry>::iterator position;
+    };
+    struct Shard {
+        mutex mtx;
+        list<Entry> lists[4];  // most recently used first
+        uint64_t bytes[4] = {0, 0, 0, 0};
+        unordered_map<string, Location> index;
+        uint64_t capacity = 0;
+        uint64_t target = 0;  // ARC p: bytes T1 should get
+        uint64_t hits = 0, misses = 0;
+
+        // Make an entry the most recent of list `to`, holding `data` (null: a ghost)
+        void move(Location &location, ListId to, Data data) {
+            Entry entry = *location.position;
+            bytes[location.queue] -= entry.size;
+            lists[location.queue].erase(location.position);
+            entry.data = data;
+            lists[to].push_front(entry);
+            bytes[to] += entry.size;
+            location = {to, lists[to].begin()};
+        }
+
+        void drop(ListId from) {
+            Entry &entry = lists[from].back();
+            bytes[from] -= entry.size;
+            index.erase(entry.key);
+            lists[from].pop_back();
+        }
+
+        // Evict from T1 or T2 into its ghost list until `incoming` more bytes fit
+        void replace(uint64_t incoming, bool ghostOfT2) {
+            while (bytes[T1] + bytes[T2] + incoming > capacity && !(lists[T1].empty() && lists[T2].empty())) {
+                bool fromT1 = !lists[T1].empty() &&
+                              (lists[T2].empty() || bytes[T1] > target || (ghostOfT2 && bytes[T1] >= target));
+                ListId from = fromT1 ? T1 : T2;
+                move(index[lists[from].back().key], fromT1 ? B1 : B2, nullptr);
+            }
+            // Ghosts describe at most one cache worth of history per side
+            while (bytes[T1] + bytes[B1] > capacity && !lists[B1].empty()) drop(B1);
+            while (bytes[T1] + bytes[T2] + bytes[B1] + bytes[B2] > 2 * capacity && !lists[B2].empty()) drop(B2);
+        }
+    };
+
+    static const size_t SHARDS = 16;
+    Shard shards[SHARDS];
+    atomic<uint64_t> capacity;
+    mutex generationMutex;
+    unordered_map<string, uint64_t> generations;
+
+    static string makeKey(const string &file, uint64_t generation, size_t chunk, uint64_t block) {
+        return file + '\n' + to_string(generation) + ':' + to_string(chunk) + ':' +
+               (block == WHOLE ? string("*") : to_string(block));
+    }
+
+    Shard &shardFor(const string &key) { return shards[hash<string>()(key) % SHARDS]; }
+
+public:
+    explicit BlockCache(uint64_t bytes) { resize(bytes); }
+
+    uint64_t size() const { return capacity; }
+
+    // Change the capacity (0 turns the cache off); cached data is dropped
+    void resize(uint64_t bytes) {
+        capacity = bytes;
+        for (auto &shard : shards) {
+            lock_guard<mutex> lock(shard.mtx);
+            for (auto &entries : shard.lists) entries.clear();
+            for (auto &total : shard.bytes) total = 0;
+            shard.index.clear();
+            shard.capacity = bytes / SHARDS;
+            shard.target = 0;
+        }
+    }
+
+    // Current generation of a file; read it together with the file's metadata
+    uint64_t generation(const string &file) {
+        lock_guard<mutex> lock(generationMutex);
+        auto entry = generations.find(file);
+        return entry == generations.end() ? 0 : entry->second;
+    }
+
+    // The file changed or went away: later reads use new keys, and what is cached is dropped
+    void invalidate(const string &file) {
+        {
+            lock_guard<mutex> lock(generationMutex);
+            generations[file]++;
+        }
+        if (capacity == 0) return;
+        string prefix = file + '\n';
+        for (auto &shard : shards) {
+            lock_guard<mutex> lock(shard.mtx);
+            for (auto &entries : shard.lists) {
+                for (auto it = entries.begin(); it != entries.end();) {
+                    if (it->key.compare(0, prefix.size(), prefix) != 0) {
+                        ++it;
+                        continue;
+                    }
+                    ListId id = shard.index[it->key].queue;
+                    shard.bytes[id] -= it->size;
+                    shard.index.erase(it->key);
+                    it = entries.erase(it);
+                }
+            }
+        }
+    }
+
+    Data get(const string &file, uint64_t generation, size_t chunk, uint64_t block) {
+        if (capacity == 0) return nullptr;
+        string key = makeKey(file, generation, chunk, block);
+        Shard &shard = shardFor(key);
+        lock_guard<mutex> lock(shard.mtx);
+        auto entry = shard.index.find(key);
+        if (entry == shard.index.end() || entry->second.queue == B1 || entry->second.queue == B2) {
+            shard.misses++;
+            return nullptr;
+        }
+        shard.hits++;
+        Data data = entry->second.position->data;
+        shard.move(entry->second, T2, data);
+        return data;
+    }
+
+    void put(const string &file, uint64_t generation, size_t chunk, uint64_t block, Data data) {
+        if (capacity == 0) return;
+        string key = makeKey(file, generation, chunk, block);
+        Shard &shard = shardFor(key);
+        uint64_t size = data->size() + key.size();
+        lock_guard<mutex> lock(shard.mtx);
+        if (size > shard.capacity) return;
+        auto entry = shard.index.find(key);
+        if (entry != shard.index.end() && (entry->second.queue == T1 || entry->second.queue == T2)) {
+            shard.move(entry->second, T2, data);  // another reader cached it meanwhile
+            return;
+        }
+
+        bool ghost = entry != shard.index.end(), inB1 = ghost && entry->second.queue == B1;
+        if (ghost) {
+            // The list that lost this key deserves more room
+            uint64_t own = max<uint64_t>(shard.bytes[inB1 ? B1 : B2], 1), other = shard.bytes[inB1 ? B2 : B1];
+            uint64_t delta = max<uint64_t>(other / own, 1) * size;
+            shard.target = inB1 ? min(shard.capacity, shard.target + delta) : shard.target - min(shard.target, delta);
+        }
+        shard.replace(size, ghost && !inB1);
+        entry = shard.index.find(key);  // making room may have forgotten the ghost
+        if (entry != shard.index.end()) {
+            shard.move(entry->second, T2, data);
+            return;
+        }
+        ListId to = ghost ? T2 : T1;
+        shard.lists[to].push_front({key, size, data});
+        shard.bytes[to] += size;
+        shard.index[key] = {to, shard.lists[to].begin()};
+    }
+
+    // "hit ratio 91.2% (1234 hits, 120 misses), 210 MiB in 215 entries of 256 MiB, ..."
+    string describe() {
+        uint64_t hits = 0, misses = 0, bytes = 0, entries = 0, recent = 0, ghosts = 0, target = 0;
+        for (auto &shard : shards) {
+            lock_guard<mutex> lock(shard.mtx);
+            hits += shard.hits;
+            misses += shard.misses;
+            bytes += shard.bytes[T1] + shard.bytes[T2];
+            recent += shard.bytes[T1];
+            entries += shard.lists[T1].size() + shard.lists[T2].size();
+            ghosts += shard.lists[B1].size() + shard.lists[B2].size();
+            target += shard.target;
+        }
+        stringstream ss;
+        ss << "hit ratio " << fixed << setprecision(1)
+           << (hits + misses ? 100.0 * hits / (hits + misses) : 0.0) << "% (" << hits << " hits, " << misses
+           << " misses), " << formatSize(bytes) << " in " << entries << " entries of " << formatSize(capacity)
+           << "; " << formatSize(recent) << " seen once (target " << formatSize(target) << "), " << ghosts
+           << " ghost keys";
+        return ss.str();
+    }
+};
+
+// Replica files held open by ReplicaViews. Removing a pinned replica waits
+// until its last view is released, and then only removes the path if it still
+// names the pinned file (a newer version may have been committed over it).
+class ReplicaPins {
+private:
+    struct Pin {
+        int views = 0;
+        bool removed = false;  // removal deferred until the last view goes
+    };
+    mutex mtx;
+    map<pair<string, ino_t>, Pin> pins;
+
+    static bool identify(const fs::path &path, ino_t &inode) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+        inode = st.st_ino;
+        return true;
+    }
+
+public:
+    void pin(const fs::path &path, ino_t inode) {
+        lock_guard<mutex> lock(mtx);
+        pins[{path.string(), inode}].views++;
+    }
+
+    void unpin(const fs::path &path, ino_t inode) {
+        lock_guard<mutex> lock(mtx);
+        auto entry = pins.find({path.string(), inode});
+        if (entry == pins.end() || --entry->second.views > 0) return;
+        ino_t current;
+        if (entry->second.removed && identify(path, current) && current == inode) {
+            error_code ec;
+            fs::remove(path, ec);
+        }
+        pins.erase(entry);
+    }
+
+    // Remove a replica file now, or once the views on it are released
+    void remove(const fs::path &path) {
+        lock_guard<mutex> lock(mtx);
+        ino_t inode;
+        if (!identify(path, inode)) return;
+        auto entry = pins.find({path.string(), inode});
+        if (entry != pins.end()) {
+            entry->second.removed = true;
+            return;
+        }
+        error_code ec;
+        fs::remove(path, ec);
+    }
+
+    // Replicas kept only because a view still holds them
+    size_t deferred() {
+        lock_guard<mutex> lock(mtx);
+        size_t count = 0;
+        for (auto &entry : pins) count += entry.second.removed;
+        return count;
+    }
+
+    size_t pinned() {
+        lock_guard<mutex> lock(mtx);
+        return pins.size();
+    }
+};
+
+// Read-only view of a whole file mapped straight from replica files, for
+// clients that embed DistributedFS and parse data in place. Copies share one
+// mapping; the replicas stay pinned until the last copy is destroyed.
+class ReplicaView {
+public:
+    const char *data() const { return start; }
+    size_t size() const { return length; }
+    string_view bytes() const { return string_view(start, length); }
+    // Node each chunk was mapped from
+    const vector<int> &sources() const { return nodes; }
+
+private:
+    friend class DistributedFS;
+
+    struct Mapping {
+        void *base = MAP_FAILED;
+        size_t length = 0;
+        shared_ptr<ReplicaPins> pins;
+        vector<pair<fs::path, ino_t>> pinned;
+
+        ~Mapping() {
+            if (base != MAP_FAILED) munmap(base, length);
+            for (auto &replica : pinned) pins->unpin(replica.first, replica.second);
+        }
+    };
+
+    shared_ptr<Mapping> mapping;
+    const char *start = nullptr;
+    size_t length = 0;
+    vector<int> nodes;
+};
+
 class Node {
 public:
-    int id;
-    bool active;
-    fs::path directory;
+    int id;
+    bool active;
+    fs::path directory;
+    unique_ptr<IoQueue> io;  // reads and writes against this node's directory
+    unique_ptr<CommitQueue> commits;  // durable rename of finished replicas
+    unique_ptr<SegmentStore> segments;  // small objects packed into segment files
+
+    Node(int id) {
+        this->id = id;
+        this->active = true;
+        this->directory = "node_" + to_string(id);
+
+        if (!fs::exists(directory))
+            fs::create_directory(directory);
+
+        // Temporary files of replicas a crash interrupted
+        fs::remove_all(directory / STAGING_DIR);
+        fs::create_directory(directory / STAGING_DIR);
+        commits.reset(new CommitQueue());
+        segments.reset(new SegmentStore(directory / SEGMENTS_DIR));
+    }
+
+    void fail() { active = false; }
+    void recover() { active = true; }
+};
+
+// One stored piece of a file and the nodes holding a replica of it
+struct ChunkInfo {
+    string object;       // name of the object inside each node directory
+    uint64_t size = 0;
+    vector<int> nodes;   // erasure-coded: nodes[i] holds shard i
+    int dataShards = 0;  // Reed-Solomon k + m; 0 for replicated chunks
+    int parityShards = 0;
+    string codec;        // compression of the stored object ("" = raw)
+    uint64_t storedSize = 0;
+    bool packed = false; // held by the nodes' segment stores instead of a file
+    // CRC32C of each 1 MiB block of a raw object, each frame of a compressed
+    // one, or each shard of an erasure-coded chunk; empty = not recorded
+    vector<uint32_t> checksums;
+
+    const vector<uint32_t> *verify() const { return checksums.empty() ? nullptr : &checksums; }
+
+    // Bytes of each replica object on disk
+    uint64_t objectSize() const { return codec.empty() ? size : storedSize; }
+
+    // Content-addressed chunks live under .objects/cas/ (cas/ in metadata written
+    // before the objects directory) and may be shared by several files
+    bool contentAddressed() const {
+        return object.rfind(string(OBJECTS_DIR) + "/cas/", 0) == 0 || object.rfind("cas/", 0) == 0;
+    }
+
+    bool erasureCoded() const { return dataShards > 0; }
+    uint64_t shardSize() const { return (size + dataShards - 1) / dataShards; }
+
+    // Object stored on nodes[slot]: the chunk itself, or its shard
+    string objectOn(size_t slot) const {
+        return erasureCoded() ? object + ".s" + to_string(slot) : object;
+    }
+};
+
+// Reference count and replica set of one content-addressed object
+struct CasEntry {
+    int refs = 0;
+    vector<int> nodes;
+    uint64_t storedSize = 0;  // object size when compressed
+    vector<uint32_t> checksums;
+};
+
+// A file is an ordered list of chunks, each with its own replica set
+struct FileInfo {
+    uint64_t size = 0;
+    vector<ChunkInfo> chunks;
+
+    // Every node holding at least one chunk, in first-seen order
+    vector<int> allNodes() const {
+        vector<int> result;
+        for (auto &chunk : chunks)
+            for (int id : chunk.nodes)
+                if (find(result.begin(), result.end(), id) == result.end())
+                    result.push_back(id);
+        return result;
+    }
+
+    // Bytes each replica set holds on disk
+    uint64_t storedSize() const {
+        uint64_t total = 0;
+        for (auto &chunk : chunks) total += chunk.objectSize();
+        return total;
+    }
+
+    // Byte offset of every chunk within the file
+    vector<uint64_t> chunkOffsets() const {
+        vector<uint64_t> offsets;
+        uint64_t offset = 0;
+        for (auto &chunk : chunks) {
+            offsets.push_back(offset);
+            offset += chunk.size;
+        }
+        return offsets;
+    }
+};
+
+// Outcome of moving one file's data onto the nodes, before it is committed
+struct UploadResult {
+    FileInfo info;
+    uint64_t chunkSize = 0;
+    size_t deduplicated = 0;
+    uint64_t savedBytes = 0;
+    vector<TransferMethod> methods;
+    bool delta = false;         // sent as a delta against the stored version
+    uint64_t literalBytes = 0;  // delta bytes the client had to send
+    uint64_t reusedBytes = 0;   // delta bytes copied from the old replicas
+    string objectPrefix;        // names this version's objects apart from the stored version's
+};
+
+// A block of the stored version, as signed for a delta re-upload
+struct DeltaBlock {
+    uint32_t chunk;   // index into the old version's chunks
+    uint64_t offset;
+    uint32_t strong;  // CRC32C of the block
+};
+
+// One run of a new chunk: a range copied from an old chunk, or literal bytes
+struct DeltaOp {
+    bool copy;
+    uint32_t chunk;
+    uint64_t source;  // offset in the old chunk, or in the new data for literals
+    uint64_t length;
+};
+
+// The old version as the base of a delta re-upload. Its replicas are opened up
+// front, so they stay readable after new replicas are renamed over them.
+struct DeltaBasis {
+    map<pair<uint32_t, int>, unique_ptr<FileDescriptor>> replicas;  // (old chunk, node)
+    unordered_map<uint32_t, vector<DeltaBlock>> blocks;             // by weak checksum
+};
+
+// A multi-part upload in progress. Parts are replicated as they arrive and
+// become the file's chunks, in part order, when the upload completes.
+struct MultipartUpload {
+    string filename;
+    map<int, ChunkInfo> parts;  // committed parts by number
+};
+
+// A replica still being written after its upload returned at the write quorum
+struct BackgroundReplica {
+    string filename;
+    size_t chunkIndex;
+    string object;
+    uint64_t size;
+    int nodeId;
+    int sourceNode;          // complete replica that fills in what the writer missed
+    fs::path temp;           // the writer's file, renamed into place once complete
+    bool done = false;
+    bool discarded = false;  // the file changed meanwhile; result no longer applies
+    string error;
+};
+
+// Replica writers of one chunk. Shared with the writer threads, so the ones
+// still running once the quorum is durable can finish in the background.
+struct ReplicaWriters {
+    struct Writer {
+        bool done = false;
+        bool demoted = false;  // dropped from the pipeline for falling behind
+        uint64_t written = 0;  // bytes known to be on disk, from offset 0
+        string error;
+        TransferMethod method = TransferMethod::Buffered;
+    };
+
+    mutex mtx;
+    condition_variable cv;
+    vector<Writer> writers;
+    vector<shared_ptr<BackgroundReplica>> handoff;  // set once the uploader moved on
+    vector<fs::path> temps;       // where each writer puts its replica until it commits
+    int completed = 0;
+    int finished = 0;
+    unique_ptr<BufferRing> ring;  // read-once pipeline; unused for zero-copy writes
+    atomic<bool> abandoned{false};  // the source failed; writers must not commit
+    uint64_t expectedSize = 0;    // final replica size when known up front, for preallocation
+    bool direct = false;          // writers bypass the page cache
+
+    explicit ReplicaWriters(size_t count) : writers(count), handoff(count), temps(count) {}
+};
+
+class DistributedFS {
+private:
+    vector<Node> nodes;
+
+    // metadata: filename → chunks and the node IDs storing each one
+    map<string, FileInfo> metadata;
+
+    // Content-addressed objects referenced by metadata (rebuilt on load)
+    map<string, CasEntry> casIndex;
+
+    // Guards metadata and casIndex while several uploads run at once
+    mutex metaMutex;
+    mutex logMutex;
+
+    const string METADATA_FILE = "metadata.txt";
+
+    // Durable replacement of metadata.txt and uploads.txt through the working
+    // directory's own staging directory
+    unique_ptr<CommitQueue> indexCommits;
+
+    // Multi-part uploads in progress, saved after every committed part
+    const string UPLOADS_FILE = "uploads.txt";
+    const int MAX_PARTS = 10000;
+    map<string, MultipartUpload> multipartUploads;
+    mutex multipartMutex;
+
+    // Upload pipeline: the source is read once into a ring of reusable buffers
+    const size_t PIPELINE_SLOTS = 8;
+    const size_t PIPELINE_BLOCK_SIZE = 1 << 20;
+
+    // Chunks are downloaded and repaired by this many workers at once
+    const size_t CHUNK_WORKERS = 4;
+
+    // Downloads read replicated chunks in stripes of this size (a multiple of
+    // CHECKSUM_BLOCK), spread over the active replicas; one worker per
+    // replica for each of CHUNK_WORKERS chunks
+    const uint64_t STRIPE_SIZE = 4 << 20;
+    const size_t STRIPE_WORKERS = CHUNK_WORKERS * REPLICATION;
+
+    // Verified read data kept in memory for downloads and range reads (0 = off)
+    BlockCache blockCache{256ULL << 20};
+
+    // Replica files held by ReplicaViews, and the views the `map` command holds
+    shared_ptr<ReplicaPins> pins = make_shared<ReplicaPins>();
+    map<string, ReplicaView> heldViews;
+
+    // Bytes of a `read` shown in its hex dump
+    const size_t READ_DUMP_LIMIT = 4096;
+
+    // Routes each download read to the replica expected to serve it fastest
+    ReplicaSelector selector;
+
+    // Hedged reads: a download read slower than this quantile of recent reads
+    // is also sent to the next best replica (0 = off). Reads that lost their
+    // race may still be running; they are counted here.
+    double hedgeQuantile = 0.95;
+    mutex hedgeMutex;
+    condition_variable hedgeIdle;
+    int hedgesRunning = 0;
+    // How often a raced read on the calling thread checks whether it lost
+    const chrono::milliseconds HEDGE_POLL{1};
+
+    // Files replicated at once by a batch upload
+    const size_t BATCH_WORKERS = 4;
+
+    // A chunk stops trying to compress after this many incompressible blocks in a row
+    const int INCOMPRESSIBLE_BLOCKS = 4;
+
+    // Compression for uploads that do not pick one; first matching rule wins
+    vector<CompressionRule> compressionRules;
+
+    // Node I/O queues: io_uring when available, otherwise blocking calls
+    bool useIoUring = true;
+    unsigned ioDepth = DEFAULT_IO_DEPTH;
+
+    // Bulk uploads and re-replication bypass the page cache (opt-in)
+    bool directMode = false;
+
+    // Replicas that must be durable before an upload returns (<= REPLICATION);
+    // the rest are completed in the background
+    int writeQuorum = REPLICATION;
+
+    // Replicas still being completed after their upload returned. Results are
+    // applied to the metadata on the command thread (applyBackgroundReplicas).
+    vector<shared_ptr<BackgroundReplica>> background;
+    mutex backgroundMutex;
+    condition_variable backgroundCv;
+
+    // Files larger than this are split into chunks with their own placement
+    uint64_t chunkSize = DEFAULT_CHUNK_SIZE;
+
+    // Save metadata to file
+    // Format: "name:nodes," followed by one tab-indented line per chunk
+    void saveMetadata() {
+        try {
+            stringstream file;
+            for (auto &entry : metadata) {
+                file << entry.first << ":";
+                for (int id : entry.second.allNodes()) {
+                    file << id << ",";
+                }
+                file << "\n";
+
+                for (auto &chunk : entry.second.chunks) {
+                    file << "\tchunk\t";
+                    writeChunkFields(file, chunk);
+                    file << "\n";
+                }
+            }
+            replaceFile(METADATA_FILE, file.str());
+        } catch (const exception &e) {
+            cout << "Warning: Failed to save metadata: " << e.what() << "\n";
+        }
+    }
+
+    // Replace `target` with `contents` the way replicas are committed: write a
+    // temporary file in .staging, make it durable, rename it over the old file
+    // and sync the directory, so a crash leaves either version whole
+    void replaceFile(const string &target, const string &contents) {
+        fs::path temp = temporaryPath(".");
+        FileDescriptor out(temp, O_WRONLY | O_CREAT | O_TRUNC);
+        try {
+            writeAt(out.fd, contents.data(), contents.size(), 0, temp.string());
+            indexCommits->commit(out.fd, temp, target);
+        } catch (const exception &) {
+            unlink(temp.c_str());
+            throw;
+        }
+    }
+
+    // Tab-separated "key=value" fields describing a chunk; the object name comes last
+    void writeChunkFields(ostream &out, const ChunkInfo &chunk) {
+        out << "size=" << chunk.size << "\tnodes=";
+        for (int id : chunk.nodes) out << id << ",";
+        if (chunk.erasureCoded())
+            out << "\tec=" << chunk.dataShards << "+" << chunk.parityShards;
+        if (!chunk.codec.empty())
+            out << "\tcodec=" << chunk.codec << "\tstored=" << chunk.storedSize;
+        if (chunk.packed) out << "\tpacked=1";
+        if (!chunk.checksums.empty()) {
+            out << "\tcrc=" << hex;
+            for (uint32_t crc : chunk.checksums) out << crc << ",";
+            out << dec;
+        }
+        out << "\tobject=" << chunk.object;
+    }
+
+    // Apply one field written by writeChunkFields; false for keys it does not know
+    bool readChunkField(const string &key, const string &value, ChunkInfo &chunk) {
+        if (key == "size") chunk.size = stoull(value);
+        else if (key == "object") chunk.object = value;
+        else if (key == "codec") chunk.codec = value;
+        else if (key == "stored") chunk.storedSize = stoull(value);
+        else if (key == "packed") chunk.packed = value == "1";
+        else if (key == "nodes") chunk.nodes = parseNodeList(value);
+        else if (key == "crc") {
+            stringstream list(value);
+            string crc;
+            while (getline(list, crc, ','))
+                if (!crc.empty()) chunk.checksums.push_back(stoul(crc, nullptr, 16));
+        }
+        else if (key == "ec") {
+            size_t plus = value.find('+');
+            chunk.dataShards = stoi(value.substr(0, plus));
+            chunk.parityShards = stoi(value.substr(plus + 1));
+        }
+        else return false;
+        return true;
+    }
+
+    // Save multi-part uploads; same layout as metadata, one "part" line per part.
+    // Call with multipartMutex held.
+    void saveUploads() {
+        try {
+            if (multipartUploads.empty()) {
+                fs::remove(UPLOADS_FILE);
+                return;
+            }
+            stringstream file;
+            for (auto &entry : multipartUploads) {
+                file << entry.first << ":" << entry.second.filename << "\n";
+                for (auto &part : entry.second.parts) {
+                    file << "\tpart\tnumber=" << part.first << "\t";
+                    writeChunkFields(file, part.second);
+                    file << "\n";
+                }
+            }
+            replaceFile(UPLOADS_FILE, file.str());
+        } catch (const exception &e) {
+            cout << "Warning: Failed to save multi-part uploads: " << e.what() << "\n";
+        }
+    }
+
+    void loadUploads() {
+        if (!fs::exists(UPLOADS_FILE)) return;
+        ifstream file(UPLOADS_FILE);
+        string line, current;
+        while (getline(file, line)) {
+            if (line.empty()) continue;
+            if (line[0] != '\t') {
+                size_t colonPos = line.find(':');
+                if (colonPos == string::npos) continue;
+                current = line.substr(0, colonPos);
+                multipartUploads[current].filename = line.substr(colonPos + 1);
+                continue;
+            }
+            if (current.empty()) continue;
+
+            ChunkInfo part;
+            int number = 0;
+            stringstream fields(line.substr(1));
+            string field;
+            getline(fields, field, '\t');
+            if (field != "part") continue;
+            while (getline(fields, field, '\t')) {
+                size_t eq = field.find('=');
+                if (eq == string::npos) continue;
+                if (field.substr(0, eq) == "number") number = stoi(field.substr(eq + 1));
+                else readChunkField(field.substr(0, eq), field.substr(eq + 1), part);
+            }
+            if (number > 0) multipartUploads[current].parts[number] = part;
+        }
+        if (!multipartUploads.empty())
+            cout << "[SYSTEM] " << multipartUploads.size() << " multi-part upload(s) can be resumed.\n\n";
+    }
+
+    // Called by each replica writer when it stops. Writers the uploader has
+    // already left behind report to the background tracker instead.
+    void finishWriter(const shared_ptr<ReplicaWriters> &group, size_t index, uint64_t written,
+                      bool demoted, const string &error, TransferMethod method) {
+        shared_ptr<BackgroundReplica> job;
+        {
+            lock_guard<mutex> lock(group->mtx);
+            ReplicaWriters::Writer &writer = group->writers[index];
+            writer.done = true;
+            writer.demoted = demoted;
+            writer.written = written;
+            writer.error = error;
+            writer.method = method;
+            group->finished++;
+            if (error.empty() && !demoted) group->completed++;
+            job = group->handoff[index];
+            group->cv.notify_all();
+        }
+        if (!job) return;
+        finishBackground(job, (demoted && error.empty()) ? completeReplica(*job, written) : error);
+    }
+
+    // Copy the part of a replica its writer missed from a complete replica
+    string completeReplica(const BackgroundReplica &job, uint64_t offset) {
+        try {
+            Node &source = nodes[job.sourceNode - 1];
+            Node &target = nodes[job.nodeId - 1];
+            FileDescriptor in(source.directory / job.object, O_RDONLY);
+            FileDescriptor out(job.temp, O_WRONLY | O_CREAT);
+            transferRange(in.fd, offset, out.fd, offset, job.size - offset,
+                          source.io.get(), target.io.get(), nullptr,
+                          directMode && job.size >= DIRECT_IO_MIN_SIZE);
+            if (ftruncate(out.fd, job.size) != 0)
+                throw runtime_error("cannot truncate " + job.temp.string() + ": " + strerror(errno));
+            target.commits->commit(out.fd, job.temp, target.directory / job.object);
+        } catch (const exception &e) {
+            unlink(job.temp.c_str());
+            return e.what();
+        }
+        return "";
+    }
+
+    shared_ptr<BackgroundReplica> trackBackground(const string &filename, size_t chunkIndex,
+                                                  const ChunkInfo &chunk, int nodeId,
+                                                  const fs::path &temp) {
+        auto job = make_shared<BackgroundReplica>();
+        job->filename = filename;
+        job->chunkIndex = chunkIndex;
+        job->object = chunk.object;
+        job->size = chunk.objectSize();
+        job->nodeId = nodeId;
+        job->sourceNode = chunk.nodes[0];
+        job->temp = temp;
+        lock_guard<mutex> lock(backgroundMutex);
+        background.push_back(job);
+        return job;
+    }
+
+    void finishBackground(const shared_ptr<BackgroundReplica> &job, const string &error) {
+        lock_guard<mutex> lock(backgroundMutex);
+        job->error = error;
+        job->done = true;
+        backgroundCv.notify_all();
+    }
+
+    bool hasBackground(const string &filename) {
+        lock_guard<mutex> lock(backgroundMutex);
+        for (auto &job : background)
+            if (job->filename == filename) return true;
+        return false;
+    }
+
+    // Wait for a file's background replicas (all files if empty). With discard,
+    // their results are dropped because the file is being replaced or deleted.
+    void waitForBackground(const string &filename, bool discard = false) {
+        unique_lock<mutex> lock(backgroundMutex);
+        backgroundCv.wait(lock, [&] {
+            for (auto &job : background)
+                if (!job->done && (filename.empty() || job->filename == filename)) return false;
+            return true;
+        });
+        if (!discard) return;
+        for (auto &job : background)
+            if (filename.empty() || job->filename == filename) job->discarded = true;
+    }
+
+    // Wait until the write quorum of a chunk is durable. Writers still running
+    // are handed to the background tracker; replicas that were demoted for
+    // falling behind are completed from one that finished.
+    bool awaitQuorum(const shared_ptr<ReplicaWriters> &group, ChunkInfo &chunk,
+                     const vector<int> &targets, int quorum, bool intact, const string &failure,
+                     const string &filename, size_t chunkIndex, vector<TransferMethod> *methods) {
+        unique_lock<mutex> lock(group->mtx);
+        group->cv.wait(lock, [&] {
+            return (intact && group->completed >= quorum) || group->finished == (int)targets.size();
+        });
+
+        chunk.nodes.clear();
+        for (size_t r = 0; r < targets.size(); r++) {
+            ReplicaWriters::Writer &writer = group->writers[r];
+            if (!writer.done || writer.demoted) continue;
+            if (writer.error.empty() && intact) {
+                chunk.nodes.push_back(targets[r]);
+                if (methods) methods->push_back(writer.method);
+            } else {
+                report("Error during file replication to Node " + to_string(targets[r]) + ": " +
+                       (writer.error.empty() ? failure : writer.error));
+            }
+        }
+
+        if ((int)chunk.nodes.size() < quorum) {
+            report("Error: Only " + to_string(chunk.nodes.size()) + " of " + to_string(quorum) +
+                   " required replicas were written.");
+            chunk.nodes = targets;
+            // Every writer has stopped; demoted ones left their files uncommitted
+            for (auto &temp : group->temps) unlink(temp.c_str());
+            return false;
+        }
+
+        for (size_t r = 0; r < targets.size(); r++) {
+            ReplicaWriters::Writer &writer = group->writers[r];
+            if (!writer.done) {
+                group->handoff[r] = trackBackground(filename, chunkIndex, chunk, targets[r], group->temps[r]);
+            } else if (writer.demoted && writer.error.empty()) {
+                auto job = trackBackground(filename, chunkIndex, chunk, targets[r], group->temps[r]);
+                uint64_t written = writer.written;
+                thread([this, job, written]() {
+                    finishBackground(job, completeReplica(*job, written));
+                }).detach();
+            }
+        }
+        return true;
+    }
+
+    // Replica writer fed by the read-once pipeline
+    void runSink(shared_ptr<ReplicaWriters> group, size_t index, int nodeId, fs::path path) {
+        BufferRing &ring = *group->ring;
+        IoQueue &io = *nodes[nodeId - 1].io;
+        const fs::path &temp = group->temps[index];
+        deque<future<ssize_t>> inFlight;
+        deque<size_t> lengths;
+        uint64_t written = 0;
+        string error;
+        try {
+            fs::create_directories(path.parent_path());
+            FileDescriptor out(temp, O_WRONLY | O_CREAT | O_TRUNC);
+            preallocate(out.fd, 0, group->expectedSize);
+            adviseSequential(out.fd, 0, group->expectedSize);
+            bool direct = group->direct && setDirectIo(out.fd, true);
+
+            const char *data;
+            size_t length;
+            uint64_t offset = 0;
+            bool ended;
+            bool inOrder = true;
+            while (true) {
+                // Keep up to the node's queue depth of slots in flight
+                if (inFlight.size() < io.depth() &&
+                    (inFlight.empty() ? ring.next(index, data, length)
+                                      : ring.tryNext(index, data, length, ended))) {
+                    // The odd-sized tail goes through the page cache, once the
+                    // aligned writes before it have been issued with O_DIRECT
+                    if (direct && !(directAligned(offset) && directAligned(length))) {
+                        for (auto &pending : inFlight) pending.wait();
+                        direct = !setDirectIo(out.fd, false);
+                    }
+                    inFlight.push_back(io.submit(true, out.fd, (char *)data, length, offset));
+                    lengths.push_back(length);
+                    offset += length;
+                    continue;
+                }
+                if (inFlight.empty()) break;  // end of stream, or demoted
+
+                ssize_t result = inFlight.front().get();
+                if (result != (ssize_t)lengths.front())
+                    throw runtime_error("write failed on " + temp.string() + ": " +
+                                        strerror(result < 0 ? -result : EIO));
+                // After a demotion the slot may have been refilled mid-write
+                inOrder = ring.release(index) && inOrder;
+                if (inOrder) written += lengths.front();
+                inFlight.pop_front();
+                lengths.pop_front();
+            }
+            // A demoted replica is committed once the background copy completes it
+            if (group->abandoned) unlink(temp.c_str());
+            else if (!ring.demoted(index)) nodes[nodeId - 1].commits->commit(out.fd, temp, path);
+        } catch (const exception &e) {
+            for (auto &pending : inFlight)
+                if (pending.valid()) pending.wait();
+            error = e.what();
+            ring.detach(index);
+            unlink(temp.c_str());
+        }
+        finishWriter(group, index, written, ring.demoted(index), error, TransferMethod::Buffered);
+    }
+
+    // Read up to `limit` bytes of the source once into the pipeline shared by
+    // one writer per target.
+    // Returns the source bytes read; a compressed chunk also gets its stored size.
+    // Every published block is checksummed as it passes.
+    uint64_t replicateStream(istream &in, ChunkInfo &chunk, const vector<int> &targets,
+                             uint64_t limit, bool exact, const UploadOptions &options,
+                             const shared_ptr<ReplicaWriters> &group, string &readError) {
+        bool compress = !chunk.codec.empty();
+        group->ring.reset(new BufferRing(PIPELINE_SLOTS, PIPELINE_BLOCK_SIZE + (compress ? FRAME_HEADER : 0),
+                                         targets.size(), options.mode == ReplicationMode::Chain,
+                                         options.quorum));
+        BufferRing &ring = *group->ring;
+        // Compressed replicas end up an unknown amount smaller, so only exact raw sizes are reserved
+        group->expectedSize = (exact && !compress) ? limit : 0;
+        group->direct = directMode && group->expectedSize >= DIRECT_IO_MIN_SIZE;
+        for (size_t i = 0; i < targets.size(); i++) {
+            group->temps[i] = temporaryPath(nodes[targets[i] - 1].directory);
+            thread(&DistributedFS::runSink, this, group, i, targets[i],
+                   nodes[targets[i] - 1].directory / chunk.object).detach();
+        }
+
+        // Single reader: each source byte is read exactly once
+        vector<char> raw(compress ? PIPELINE_BLOCK_SIZE : 0);
+        int rawRun = 0;  // consecutive blocks that did not compress
+        uint64_t total = 0, stored = 0;
+        chunk.checksums.clear();
+        while (total < limit) {
+            char *buffer = ring.acquire();
+            if (!buffer) break;
+            char *block = compress ? raw.data() : buffer;
+            in.read(block, min<uint64_t>(PIPELINE_BLOCK_SIZE, limit - total));
+            size_t length = in.gcount();
+            if (in.bad()) {
+                readError = "read error on upload source";
+                break;
+            }
+            if (length == 0) break;
+
+            // Compress once here, so every replica receives the smaller frames.
+            // Give up on data that keeps coming out incompressible.
+            size_t published = length;
+            if (compress) {
+                if (total == 0 && looksCompressed(block, length)) rawRun = INCOMPRESSIBLE_BLOCKS;
+                published = encodeFrame(block, length, buffer, options.compressionLevel,
+                                        rawRun < INCOMPRESSIBLE_BLOCKS);
+                rawRun = (published == FRAME_HEADER + length) ? rawRun + 1 : 0;
+            }
+            chunk.checksums.push_back(crc32c(buffer, published));
+            ring.publish(published);
+            total += length;
+            stored += published;
+        }
+        if (readError.empty() && exact && total != limit) readError = "source changed during upload";
+        // Writers decide whether to commit when they see the end of the stream
+        group->abandoned = !readError.empty();
+        ring.publish(0);
+        chunk.storedSize = stored;
+        return total;
+    }
+
+    // IDs of all currently active nodes
+    vector<int> activeNodeIds() {
+        vector<int> ids;
+        for (auto &node : nodes)
+            if (node.active) ids.push_back(node.id);
+        return ids;
+    }
+
+    // Chunk i starts at the i-th active node so chunks spread over all nodes
+    vector<int> placeChunk(const vector<int> &active, size_t index, size_t count = 0) {
+        vector<int> targets;
+        for (size_t r = 0; r < min<size_t>(count ? count : REPLICATION, active.size()); r++)
+            targets.push_back(active[(index + r) % active.size()]);
+        return targets;
+    }
+
+    // Print one line; safe to call from upload worker threads
+    void report(const string &message) {
+        lock_guard<mutex> lock(logMutex);
+        cout << message << "\n";
+    }
+
+    // Number of nodes in the list that are currently active
+    int countActive(const vector<int> &nodeList) {
+        int activeCount = 0;
+        for (int id : nodeList)
+            if (nodes[id - 1].active) activeCount++;
+        return activeCount;
+    }
+
+    // Append a chunk to a file, taking a reference on content-addressed objects
+    void addChunk(FileInfo &info, const ChunkInfo &chunk) {
+        info.chunks.push_back(chunk);
+        info.size += chunk.size;
+
+        if (chunk.contentAddressed()) {
+            lock_guard<mutex> lock(metaMutex);
+            CasEntry &entry = casIndex[chunk.object];
+            entry.refs++;
+            entry.storedSize = chunk.storedSize;
+            entry.checksums = chunk.checksums;
+            for (int id : chunk.nodes)
+                if (find(entry.nodes.begin(), entry.nodes.end(), id) == entry.nodes.end())
+                    entry.nodes.push_back(id);
+        }
+    }
+
+    // After a repair, every file referencing the object sees the new replica set
+    void shareCasReplicas(const ChunkInfo &chunk) {
+        casIndex[chunk.object].nodes = chunk.nodes;
+        for (auto &entry : metadata)
+            for (auto &other : entry.second.chunks)
+                if (other.object == chunk.object) other.nodes = chunk.nodes;
+    }
+
+    // Stream one chunk to its targets; false if fewer than `quorum` replicas succeeded
+    // With `exact`, a source shorter than `expected` means it changed during the upload;
+    // otherwise `expected` only caps the chunk and a stream may end early
+    bool storeChunk(istream &in, ChunkInfo &chunk, const vector<int> &targets, uint64_t expected,
+                    bool exact, const UploadOptions &options, const string &filename,
+                    size_t chunkIndex) {
+        auto group = make_shared<ReplicaWriters>(targets.size());
+        string readError;
+        chunk.codec = options.compression;
+        chunk.size = replicateStream(in, chunk, targets, expected, exact, options, group, readError);
+        return awaitQuorum(group, chunk, targets, options.quorum, readError.empty(), readError,
+                           filename, chunkIndex, nullptr);
+    }
+    bool storeChunkZeroCopy(const string &source, uint64_t offset, ChunkInfo &chunk,
+                            const vector<int> &targets, int quorum, const string &filename,
+                            size_t chunkIndex, vector<TransferMethod> &methods) {
+        // The copies bypass this process, so checksum the source range up front
+        try {
+            FileDescriptor in(source, O_RDONLY);
+            vector<char> block(CHECKSUM_BLOCK);
+            chunk.checksums.clear();
+            for (uint64_t done = 0; done < chunk.size;) {
+                size_t length = min<uint64_t>(CHECKSUM_BLOCK, chunk.size - done);
+                if (pread(in.fd, block.data(), length, offset + done) != (ssize_t)length)
+                    throw runtime_error("cannot read " + source);
+                chunk.checksums.push_back(crc32c(block.data(), length));
+                done += length;
+            }
+        } catch (const exception &e) {
+            report("Error during file replication: " + string(e.what()));
+            return false;
+        }
+
+        auto group = make_shared<ReplicaWriters>(targets.size());
+        for (size_t r = 0; r < targets.size(); r++) {
+            Node &node = nodes[targets[r] - 1];
+            fs::path path = node.directory / chunk.object;
+            fs::path temp = group->temps[r] = temporaryPath(node.directory);
+            uint64_t size = chunk.size;
+            // Writers own their descriptors: they may outlive this upload
+            thread([this, group, r, source, offset, path, temp, size, &node]() {
+                TransferMethod used = TransferMethod::Buffered;
+                string error;
+                try {
+                    FileDescriptor in(source, O_RDONLY);
+                    fs::create_directories(path.parent_path());
+                    FileDescriptor out(temp, O_WRONLY | O_CREAT | O_TRUNC);
+                    used = transferRange(in.fd, offset, out.fd, 0, size);
+                    node.commits->commit(out.fd, temp, path);
+                } catch (const exception &e) {
+                    error = e.what();
+                    unlink(temp.c_str());
+                }
+                finishWriter(group, r, size, false, error, used);
+            }).detach();
+        }
+        return awaitQuorum(group, chunk, targets, quorum, true, "", filename, chunkIndex, &methods);
+    }
+    // Read shard `slot` of an erasure-coded chunk; false if its node or file is
+    // unavailable or the shard fails its checksum
+    bool readShard(const ChunkInfo &chunk, size_t slot, uint8_t *buffer) {
+        Node &node = nodes[chunk.nodes[slot] - 1];
+        if (!node.active) return false;
+        try {
+            FileDescriptor in(node.directory / chunk.objectOn(slot), O_RDONLY);
+            uint64_t length = chunk.shardSize();
+            if (in.size() != length) return false;
+            for (uint64_t done = 0; done < length;) {
+                ssize_t got = node.io->submit(false, in.fd, (char *)buffer + done, length - done, done).get();
+                if (got <= 0) return false;
+                done += got;
+            }
+        } catch (const exception &) {
+            return false;
+        }
+        if (slot < chunk.checksums.size() && crc32c(buffer, chunk.shardSize()) != chunk.checksums[slot]) {
+            report("[CORRUPTION] " + chunk.objectOn(slot) + " on Node " + to_string(node.id) +
+                   " failed its checksum; treating the shard as lost.");
+            return false;
+        }
+        return true;
+    }
+    void writeShard(int nodeId, const string &object, const uint8_t *data, uint64_t length) {
+        Node &node = nodes[nodeId - 1];
+        fs::path path = node.directory / object, temp = temporaryPath(node.directory);
+        fs::create_directories(path.parent_path());
+        FileDescriptor out(temp, O_WRONLY | O_CREAT | O_TRUNC);
+        preallocate(out.fd, 0, length);
+        try {
+            ssize_t written = length ? node.io->submit(true, out.fd, (char *)data, length, 0).get() : 0;
+            if (written != (ssize_t)length)
+                throw runtime_error("write failed on " + temp.string() + ": " +
+                                    strerror(written < 0 ? -written : EIO));
+            node.commits->commit(out.fd, temp, path);
+        } catch (const exception &) {
+            unlink(temp.c_str());
+            throw;
+        }
+    }
+
+    // Cut one chunk into k data and m parity shards, one per target node.
+    // Every shard has to be written; there is no quorum for erasure-coded chunks.
+    bool storeChunkErasure(istream &in, ChunkInfo &chunk, const vector<int> &targets,
+                           uint64_t expected, bool exact, const UploadOptions &options) {
+        int k = options.dataShards, m = options.parityShards;
+        chunk.dataShards = k;
+        chunk.parityShards = m;
+
+        // Zero-filled, so the last data shard comes padded
+        vector<uint8_t> buffer(expected + k);
+        in.read((char *)buffer.data(), expected);
+        chunk.size = in.gcount();
+        if (in.bad() || (exact && chunk.size != expected)) {
+            report("Error during file replication: " +
+                   string(in.bad() ? "read error on upload source" : "source changed during upload"));
+            return false;
+        }
+
+        uint64_t shardSize = chunk.shardSize();
+        vector<uint8_t> parity(shardSize * m);
+        vector<const uint8_t *> dataShards;
+        vector<uint8_t *> parityShards;
+        for (int i = 0; i < k; i++) dataShards.push_back(buffer.data() + i * shardSize);
+        for (int i = 0; i < m; i++) parityShards.push_back(parity.data() + i * shardSize);
+        ReedSolomon(k, m).encode(dataShards, parityShards, shardSize);
+        chunk.checksums.clear();
+        for (int i = 0; i < k; i++) chunk.checksums.push_back(crc32c(dataShards[i], shardSize));
+        for (int i = 0; i < m; i++) chunk.checksums.push_back(crc32c(parityShards[i], shardSize));
+
+        vector<string> errors(k + m);
+        runParallel(k + m, k + m, [&](size_t i) {
+            try {
+                writeShard(targets[i], chunk.objectOn(i),
+                           (int)i < k ? dataShards[i] : parityShards[i - k], shardSize);
+            } catch (const exception &e) {
+                errors[i] = e.what();
+            }
+        });
+        chunk.nodes = targets;
+
+        int written = 0;
+        for (size_t i = 0; i < errors.size(); i++) {
+            if (errors[i].empty()) written++;
+            else report("Error during shard write to Node " + to_string(targets[i]) + ": " + errors[i]);
+        }
+        if (written < k + m) {
+            report("Error: Only " + to_string(written) + " of " + to_string(k + m) +
+                   " shards were written.");
+            return false;
+        }
+        return true;
+    }
+
+    // Whole object from one node, read through its I/O queue
+    vector<char> readObject(Node &node, const string &object) {
+        fs::path path = node.directory / object;
+        FileDescriptor in(path, O_RDONLY);
+        vector<char> data(in.size());
+        for (uint64_t done = 0; done < data.size();) {
+            ssize_t got = node.io->submit(false, in.fd, data.data() + done, data.size() - done, done).get();
+            if (got <= 0) throw runtime_error("read failed on " + path.string());
+            done += got;
+        }
+        return data;
+    }
+
+    // Stored bytes of a replicated chunk on `node`, from its file or segment store
+    vector<char> readReplica(const ChunkInfo &chunk, Node &node) {
+        return chunk.packed ? node.segments->get(chunk.object) : readObject(node, chunk.object);
+    }
+
+    // Copy `length` bytes at `offset` of a plain replicated chunk from `node` into
+    // `target` (where the chunk starts at `chunkOffset`), verifying the blocks
+    TransferMethod readStripe(const ChunkInfo &chunk, Node &node, const string &target,
+                              uint64_t chunkOffset, uint64_t offset, uint64_t length) {
+        FileDescriptor in(node.directory / chunk.object, O_RDONLY);
+        FileDescriptor out(target, O_RDWR);
+        if (in.size() != chunk.size) throw ChecksumError("replica has the wrong size");
+        vector<uint32_t> checksums;
+        if (chunk.verify()) {
+            size_t first = offset / CHECKSUM_BLOCK, count = (length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK;
+            if (first + count > chunk.checksums.size()) throw ChecksumError("missing block checksums");
+            checksums.assign(chunk.checksums.begin() + first, chunk.checksums.begin() + first + count);
+        }
+        try {
+            return transferRange(in.fd, offset, out.fd, chunkOffset + offset, length, node.io.get(), nullptr,
+                                 chunk.verify() ? &checksums : nullptr);
+        } catch (const ChecksumError &e) {
+            throw ChecksumError(string(e.what()) + " of the stripe at " + formatSize(offset));
+        }
+    }
+
+    // Read `length` bytes at `offset` of a replicated chunk's object on `node`
+    // into memory through its I/O queue, checking the blocks of a plain chunk as
+    // they arrive. Stops early, with an error, once `cancelled` is set. `slow`,
+    // if given, is called once when the reads have not finished by `deadline`;
+    // from then on a read stuck on the disk no longer holds up the caller once
+    // `cancelled` is set, but is left to finish in the background.
+    vector<char> fetchStripe(const ChunkInfo &chunk, Node &node, uint64_t offset, uint64_t length,
+                             const atomic<bool> &cancelled,
+                             chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point(),
+                             const function<void()> &slow = nullptr) {
+        auto in = make_shared<FileDescriptor>(node.directory / chunk.object, O_RDONLY);
+        if (in->size() != chunk.objectSize()) throw ChecksumError("replica has the wrong size");
+        auto data = make_shared<vector<char>>(length);
+        IoQueue &io = *node.io;
+        deque<pair<future<ssize_t>, uint64_t>> inFlight;  // pending reads and their stripe offsets
+        auto drain = [&] {
+            for (auto &pending : inFlight) pending.first.wait();
+        };
+        bool beforeDeadline = (bool)slow, raced = false;
+        for (uint64_t next = 0; next < length || !inFlight.empty();) {
+            while (!cancelled && inFlight.size() < max(1u, io.depth()) && next < length) {
+                size_t n = min<uint64_t>(CHECKSUM_BLOCK, length - next);
+                inFlight.emplace_back(io.submit(false, in->fd, data->data() + next, n, offset + next), next);
+                next += n;
+            }
+            if (inFlight.empty()) throw runtime_error("read cancelled");
+
+            future<ssize_t> &front = inFlight.front().first;
+            if (beforeDeadline && front.wait_until(deadline) == future_status::timeout) {
+                beforeDeadline = false;
+                raced = true;
+                slow();
+            }
+            while (raced && front.wait_for(HEDGE_POLL) == future_status::timeout) {
+                if (!cancelled) continue;
+                // Another replica answered: the buffer and descriptor stay alive until the queue is done with them
+                {
+                    lock_guard<mutex> lock(hedgeMutex);
+                    hedgesRunning++;
+                }
+                thread([this, in, data, pending = move(inFlight)]() mutable {
+                    for (auto &read : pending) read.first.wait();
+                    data.reset();
+                    in.reset();
+                    lock_guard<mutex> lock(hedgeMutex);
+                    if (--hedgesRunning == 0) hedgeIdle.notify_all();
+                }).detach();
+                throw runtime_error("read cancelled");
+            }
+
+            ssize_t result = front.get();
+            uint64_t at = inFlight.front().second;
+            inFlight.pop_front();
+            size_t n = min<uint64_t>(CHECKSUM_BLOCK, length - at);
+            if (result != (ssize_t)n) {
+                drain();
+                throw runtime_error("read failed on " + chunk.object + ": " + strerror(result < 0 ? -result : EIO));
+            }
+            size_t index = (offset + at) / CHECKSUM_BLOCK;
+            if (chunk.codec.empty() && chunk.verify() &&
+                (index >= chunk.checksums.size() || crc32c(data->data() + at, n) != chunk.checksums[index])) {
+                drain();
+                throw ChecksumError("checksum mismatch in block " + to_string(index));
+            }
+        }
+        return move(*data);
+    }
+
+    // Stored bytes of a packed or compressed chunk from `node`, verified
+    vector<char> fetchBuffered(const ChunkInfo &chunk, Node &node) {
+        vector<char> stored = readReplica(chunk, node);
+        if (chunk.codec.empty() && stored.size() != chunk.size)
+            throw runtime_error("object " + chunk.object + " on Node " + to_string(node.id) + " has the wrong size");
+        if (chunk.verify() && chunk.codec.empty()) verifyBlocks(stored.data(), stored.size(), chunk.checksums);
+        else if (chunk.verify()) verifyFrames(stored, chunk.checksums);
+        return stored;
+    }
+
+    // Write the stored bytes of a packed or compressed chunk into `target` at
+    // `offset`, expanding them if compressed
+    void writeStored(const ChunkInfo &chunk, const vector<char> &stored, const string &target, uint64_t offset) {
+        FileDescriptor out(target, O_WRONLY);
+        if (chunk.codec.empty()) {
+            writeAt(out.fd, stored.data(), stored.size(), offset, target);
+            return;
+        }
+        vector<char> scratch;
+        uint64_t produced = 0;
+        for (size_t pos = 0; pos < stored.size();) {
+            uint32_t length;
+            const char *data = decodeFrame(stored, pos, scratch, length);
+            if (produced + length > chunk.size) break;
+            writeAt(out.fd, data, length, offset + produced, target);
+            produced += length;
+        }
+        if (produced != chunk.size)
+            throw runtime_error("corrupt object " + chunk.object + ": expands to the wrong size");
+    }
+
+    static void writeAt(int fd, const char *data, uint64_t length, uint64_t offset, const string &target) {
+        for (uint64_t done = 0; done < length;) {
+            ssize_t written = pwrite(fd, data + done, length - done, offset + done);
+            if (written <= 0) throw runtime_error("write failed on " + target + ": " + strerror(errno));
+            done += written;
+        }
+    }
+
+    // Write a packed chunk from `node` into `target` at `offset`, expanding it if compressed
+    void readBufferedChunk(const ChunkInfo &chunk, Node &node, const string &target, uint64_t offset) {
+        writeStored(chunk, fetchBuffered(chunk, node), target, offset);
+    }
+
+    // One read of a hedged race, on the calling thread or a hedge thread. The
+    // first verified answer becomes the race's data; packed chunks are one small
+    // pread from the segment store, the rest go through the node's I/O queue.
+    void raceRead(HedgedRead &race, const ChunkInfo &chunk, int nodeId, uint64_t offset, uint64_t length,
+                  chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point(),
+                  const function<void()> &slow = nullptr) {
+        Node &node = nodes[nodeId - 1];
+        auto started = chrono::steady_clock::now();
+        vector<char> data;
+        string error;
+        try {
+            if (chunk.packed) {
+                data = fetchBuffered(chunk, node);
+            } else if (chunk.codec.empty()) {
+                data = fetchStripe(chunk, node, offset, length, race.cancelled, deadline, slow);
+            } else {
+                data = fetchStripe(chunk, node, 0, chunk.storedSize, race.cancelled, deadline, slow);
+                if (chunk.verify()) verifyFrames(data, chunk.checksums);
+            }
+        } catch (const ChecksumError &e) {
+            error = e.what();
+            report("[CORRUPTION] " + chunk.object + " on Node " + to_string(nodeId) + ": " + error + ".");
+        } catch (const exception &e) {
+            error = e.what();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        // A cancelled read took at least this long: a lower bound on its latency
+        bool failed = !error.empty() && !race.cancelled;
+        selector.finish(nodeId, failed ? 0 : length, seconds, failed);
+
+        lock_guard<mutex> lock(race.mtx);
+        if (error.empty() && race.winner == -1) {
+            race.winner = nodeId;
+            race.data = move(data);
+            race.cancelled = true;
+        } else if (!error.empty() && race.winner == -1) {
+            race.error = error;
+        }
+        race.running--;
+        race.cv.notify_all();
+    }
+
+    // Read one download unit (`length` bytes at `offset` of a plain chunk, or a
+    // whole packed or compressed chunk) from the best of `replicas`. The read
+    // runs on the calling thread; if it has not answered within the hedge
+    // percentile of recent reads, the same read goes to the next best replica
+    // on a thread of its own, the first verified answer wins and the other read
+    // is cancelled. A failed read moves on to the next replica. Returns the
+    // stored bytes and sets the node that served them.
+    vector<char> hedgedRead(const ChunkInfo &chunk, vector<int> replicas, uint64_t offset, uint64_t length,
+                            int &source, bool &hedged) {
+        if (replicas.empty()) throw runtime_error("All replicas are unavailable.");
+        auto race = make_shared<HedgedRead>();
+        auto pickNext = [&] {
+            int nodeId = selector.pick(replicas);
+            replicas.erase(find(replicas.begin(), replicas.end(), nodeId));
+            return nodeId;
+        };
+
+        // A hedge runs detached: if it loses on a stalled disk it must not hold up the download
+        auto hedge = [&] {
+            int nodeId = pickNext();
+            hedged = true;
+            {
+                lock_guard<mutex> lock(race->mtx);
+                race->running++;
+            }
+            {
+                lock_guard<mutex> lock(hedgeMutex);
+                hedgesRunning++;
+            }
+            thread([this, race, chunk, nodeId, offset, length]() {
+                raceRead(*race, chunk, nodeId, offset, length);
+                lock_guard<mutex> lock(hedgeMutex);
+                if (--hedgesRunning == 0) hedgeIdle.notify_all();
+            }).detach();
+        };
+
+        hedged = false;
+        double delay = hedgeQuantile > 0 ? selector.percentile(hedgeQuantile) * max(length / double(1 << 20), 1.0)
+                                         : 0;  // milliseconds; 0 = no hedge
+        while (true) {
+            int nodeId = pickNext();
+            bool hedgeable = delay > 0 && !hedged && !replicas.empty();
+            {
+                lock_guard<mutex> lock(race->mtx);
+                race->running++;
+            }
+            raceRead(*race, chunk, nodeId, offset, length,
+                     chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                                                       chrono::duration<double, milli>(delay)),
+                     hedgeable ? function<void()>(hedge) : nullptr);
+
+            // A failed read waits for a running hedge before trying the next replica
+            unique_lock<mutex> lock(race->mtx);
+            race->cv.wait(lock, [&] { return race->winner != -1 || race->running == 0; });
+            if (race->winner != -1) break;
+            if (replicas.empty())
+                throw runtime_error("no replica of " + chunk.object + " could be read: " + race->error);
+        }
+        source = race->winner;
+        return move(race->data);
+    }
+
+    // Bytes [from, to) of plain chunk `index` of a file, both on checksum block
+    // boundaries (or `to` at the chunk end). Blocks in the cache are served from it; each run of
+    // missing blocks is read from the replicas (hedged) and cached. `source` is
+    // the last node read, or 0 if everything came from the cache.
+    vector<char> readBlocks(const string &filename, uint64_t generation, size_t index, const ChunkInfo &chunk,
+                            const vector<int> &replicas, uint64_t from, uint64_t to, int &source, bool &hedged) {
+        vector<char> result(to - from);
+        uint64_t first = from / CHECKSUM_BLOCK, last = (to + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK;
+        vector<BlockCache::Data> cached;
+        for (uint64_t block = first; block < last; block++)
+            cached.push_back(blockCache.get(filename, generation, index, block));
+
+        source = 0;
+        hedged = false;
+        for (uint64_t block = first; block < last;) {
+            if (cached[block - first]) {
+                memcpy(result.data() + (block * CHECKSUM_BLOCK - from), cached[block - first]->data(),
+                       cached[block - first]->size());
+                block++;
+                continue;
+            }
+            uint64_t end = block + 1;
+            while (end < last && !cached[end - first]) end++;
+            uint64_t runFrom = block * CHECKSUM_BLOCK, runTo = min(to, end * CHECKSUM_BLOCK);
+            bool runHedged;
+            vector<char> data = hedgedRead(chunk, replicas, runFrom, runTo - runFrom, source, runHedged);
+            hedged = hedged || runHedged;
+            memcpy(result.data() + (runFrom - from), data.data(), data.size());
+            for (; block < end; block++) {
+                uint64_t at = block * CHECKSUM_BLOCK - runFrom;
+                auto piece = make_shared<const vector<char>>(data.begin() + at,
+                                                             data.begin() + min<uint64_t>(data.size(), at + CHECKSUM_BLOCK));
+                blockCache.put(filename, generation, index, block, piece);
+            }
+        }
+        return result;
+    }
+
+    // The verified stored bytes of packed or compressed chunk `index` of a file,
+    // from the block cache or the replicas
+    vector<char> readStored(const string &filename, uint64_t generation, size_t index, const ChunkInfo &chunk,
+                            const vector<int> &replicas, int &source, bool &hedged) {
+        hedged = false;
+        if (auto cached = blockCache.get(filename, generation, index, BlockCache::WHOLE)) {
+            source = 0;
+            return *cached;
+        }
+        vector<char> data = hedgedRead(chunk, replicas, 0, chunk.size, source, hedged);
+        blockCache.put(filename, generation, index, BlockCache::WHOLE, make_shared<const vector<char>>(data));
+        return data;
+    }
+
+    // Wait until hedged reads that lost their race have stopped
+    void waitForHedges() {
+        unique_lock<mutex> lock(hedgeMutex);
+        hedgeIdle.wait(lock, [&] { return hedgesRunning == 0; });
+    }
+
+    // Write an erasure-coded chunk into `target` at `offset`. Unverified data shards
+    // are copied straight through when all are readable; checksummed ones are read
+    // and checked first. Any k good shards are decoded when a data shard is missing.
+    TransferMethod readErasureChunk(const ChunkInfo &chunk, const string &target, uint64_t offset,
+                                    bool &decoded) {
+        int k = chunk.dataShards;
+        uint64_t shardSize = chunk.shardSize();
+        FileDescriptor out(target, O_WRONLY);
+
+        decoded = !chunk.checksums.empty();
+        for (int i = 0; i < k && !decoded; i++)
+            decoded = !nodes[chunk.nodes[i] - 1].active ||
+                      !fs::exists(nodes[chunk.nodes[i] - 1].directory / chunk.objectOn(i));
+        if (!decoded) {
+            try {
+                TransferMethod method = TransferMethod::Buffered;
+                for (int i = 0; i < k && i * shardSize < chunk.size; i++) {
+                    Node &node = nodes[chunk.nodes[i] - 1];
+                    FileDescriptor in(node.directory / chunk.objectOn(i), O_RDONLY);
+                    method = transferRange(in.fd, 0, out.fd, offset + i * shardSize,
+                                           min(shardSize, chunk.size - i * shardSize), node.io.get());
+                }
+                return method;
+            } catch (const exception &) {
+                decoded = true;  // a shard went away meanwhile; decode instead
+            }
+        }
+
+        vector<uint8_t> buffer;
+        decoded = loadErasureChunk(chunk, buffer);
+        writeAt(out.fd, (const char *)buffer.data(), chunk.size, offset, target);
+        return TransferMethod::Buffered;
+    }
+
+    // Load the first k good shards of an erasure-coded chunk into `buffer` and
+    // rebuild any missing data shard; the chunk's bytes are then contiguous at the
+    // start of the buffer. Returns whether a data shard had to be rebuilt.
+    bool loadErasureChunk(const ChunkInfo &chunk, vector<uint8_t> &buffer) {
+        int k = chunk.dataShards, m = chunk.parityShards;
+        uint64_t shardSize = chunk.shardSize();
+        buffer.assign(shardSize * (k + m), 0);
+        vector<uint8_t *> shards;
+        vector<bool> present(k + m, false);
+        int available = 0;
+        for (int i = 0; i < k + m; i++) {
+            shards.push_back(buffer.data() + i * shardSize);
+            if (available < k && readShard(chunk, i, shards[i])) {
+                present[i] = true;
+                available++;
+            }
+        }
+        bool decoded = find(present.begin(), present.begin() + k, false) != present.begin() + k;
+        if (decoded) ReedSolomon(k, m).reconstruct(shards, present, shardSize);
+        return decoded;
+    }
+
+    // Bytes [from, to) of an erasure-coded chunk: just the data shards holding
+    // them, or a full decode when one of those is unavailable
+    vector<char> readErasureRange(const ChunkInfo &chunk, uint64_t from, uint64_t to) {
+        uint64_t shardSize = chunk.shardSize();
+        vector<char> result;
+        vector<uint8_t> shard(shardSize);
+        for (uint64_t slot = from / shardSize; slot * shardSize < to; slot++) {
+            if (!readShard(chunk, slot, shard.data())) {
+                vector<uint8_t> buffer;
+                loadErasureChunk(chunk, buffer);
+                return vector<char>(buffer.begin() + from, buffer.begin() + to);
+            }
+            uint64_t start = max(from, slot * shardSize), end = min(to, (slot + 1) * shardSize);
+            result.insert(result.end(), shard.begin() + (start - slot * shardSize),
+                          shard.begin() + (end - slot * shardSize));
+        }
+        return result;
+    }
+
+    // Raw bytes [from, to) of a compressed object; frames before the range are
+    // skipped by their headers without being decoded
+    static vector<char> expandRange(const vector<char> &stored, uint64_t from, uint64_t to) {
+        vector<char> result, scratch;
+        uint64_t produced = 0;
+        for (size_t pos = 0; pos < stored.size() && produced < to;) {
+            uint32_t header[2];
+            if (stored.size() - pos < FRAME_HEADER) throw runtime_error("truncated frame header");
+            memcpy(header, stored.data() + pos, FRAME_HEADER);
+            if (produced + header[1] <= from) {
+                pos += FRAME_HEADER + (header[0] & ~FRAME_RAW);
+                produced += header[1];
+                continue;
+            }
+            uint32_t length;
+            const char *data = decodeFrame(stored, pos, scratch, length);
+            uint64_t start = max(from, produced), end = min(to, produced + length);
+            result.insert(result.end(), data + (start - produced), data + (end - produced));
+            produced += length;
+        }
+        if (result.size() != to - from) throw runtime_error("compressed object ends early");
+        return result;
+    }
+
+    // Rebuild shards whose node is down or lost the file onto active nodes that
+    // hold no shard of this chunk yet
+    vector<string> repairErasureChunk(const string &filename, ChunkInfo &chunk, const string &label) {
+        vector<string> log;
+        int k = chunk.dataShards, m = chunk.parityShards;
+
+        vector<int> spare;
+        for (auto &node : nodes)
+            if (node.active && find(chunk.nodes.begin(), chunk.nodes.end(), node.id) == chunk.nodes.end())
+                spare.push_back(node.id);
+        int lost = 0;
+        for (int i = 0; i < k + m; i++)
+            if (!nodes[chunk.nodes[i] - 1].active ||
+                !fs::exists(nodes[chunk.nodes[i] - 1].directory / chunk.objectOn(i)))
+                lost++;
+        if (lost == 0 || spare.empty()) return log;
+
+        uint64_t shardSize = chunk.shardSize();
+        vector<uint8_t> buffer(shardSize * (k + m));
+        vector<uint8_t *> shards;
+        vector<bool> present(k + m);
+        for (int i = 0; i < k + m; i++) {
+            shards.push_back(buffer.data() + i * shardSize);
+            present[i] = readShard(chunk, i, shards[i]);
+        }
+
+        try {
+            ReedSolomon(k, m).reconstruct(shards, present, shardSize);
+            for (int i = 0; i < k + m && !spare.empty(); i++) {
+                if (present[i]) continue;
+                int target = spare.front();
+                spare.erase(spare.begin());
+                writeShard(target, chunk.objectOn(i), shards[i], shardSize);
+
+                pins->remove(nodes[chunk.nodes[i] - 1].directory / chunk.objectOn(i));
+                chunk.nodes[i] = target;
+                log.push_back("RE-REPLICATED: File '" + filename + "'" + label + " shard " +
+                              to_string(i) + " rebuilt on Node " + to_string(target) + ".");
+            }
+        } catch (const exception &e) {
+            log.push_back(string("Error during re-replication: ") + e.what());
+        }
+        return log;
+    }
+
+    // Re-uploads are sent as deltas when both versions are plain replicated files
+    bool deltaApplies(const FileInfo &old, uint64_t size, const UploadOptions &options) {
+        if (!options.delta || old.chunks.empty() || size == UNKNOWN_SIZE || options.zeroCopy ||
+            options.dataShards || !options.compression.empty() || options.chunking != ChunkingMode::Fixed)
+            return false;
+        for (auto &chunk : old.chunks)
+            if (chunk.erasureCoded() || chunk.packed || !chunk.codec.empty() || chunk.contentAddressed())
+                return false;
+        return true;
+    }
+
+    // rsync's receiver side: open the old replicas and sign each old chunk block
+    // by block on one node that holds it
+    void signOldVersion(const FileInfo &old, DeltaBasis &basis) {
+        vector<char> buffer(PIPELINE_BLOCK_SIZE);
+        for (uint32_t j = 0; j < old.chunks.size(); j++) {
+            const ChunkInfo &chunk = old.chunks[j];
+            int signer = -1;
+            for (int id : chunk.nodes) {
+                if (!nodes[id - 1].active) continue;
+                try {
+                    unique_ptr<FileDescriptor> replica(
+                        new FileDescriptor(nodes[id - 1].directory / chunk.object, O_RDONLY));
+                    if (replica->size() != chunk.size) continue;
+                    basis.replicas[{j, id}] = move(replica);
+                    if (signer == -1) signer = id;
+                } catch (const exception &) {
+                }
+            }
+            if (signer == -1) continue;
+
+            Node &node = nodes[signer - 1];
+            int fd = basis.replicas[{j, signer}]->fd;
+            uint64_t whole = chunk.size - chunk.size % DELTA_BLOCK;  // a short tail is never matched
+            for (uint64_t offset = 0; offset < whole;) {
+                size_t length = min<uint64_t>(buffer.size(), whole - offset);
+                if (node.io->submit(false, fd, buffer.data(), length, offset).get() != (ssize_t)length)
+                    break;
+                for (size_t at = 0; at < length; at += DELTA_BLOCK) {
+                    RollingChecksum weak;
+                    weak.reset((const uint8_t *)buffer.data() + at, DELTA_BLOCK);
+                    basis.blocks[weak.digest()].push_back(
+                        {j, offset + at, crc32c(buffer.data() + at, DELTA_BLOCK)});
+                }
+                offset += length;
+            }
+        }
+    }
+
+    // rsync's sender side: slide the rolling checksum over the new data and turn
+    // it into copies of old blocks and literal runs
+    vector<DeltaOp> computeDelta(const char *data, uint64_t length, const DeltaBasis &basis) {
+        vector<DeltaOp> ops;
+        auto emit = [&](bool copy, uint32_t chunk, uint64_t source, uint64_t count) {
+            if (!ops.empty()) {
+                DeltaOp &last = ops.back();
+                if (last.copy == copy && last.chunk == chunk && last.source + last.length == source) {
+                    last.length += count;
+                    return;
+                }
+            }
+            ops.push_back({copy, chunk, source, count});
+        };
+
+        const uint8_t *bytes = (const uint8_t *)data;
+        RollingChecksum weak;
+        bool primed = false;
+        uint64_t pos = 0;
+        while (pos + DELTA_BLOCK <= length) {
+            if (!primed) weak.reset(bytes + pos, DELTA_BLOCK);
+            primed = true;
+
+            // Among equal blocks, prefer the one continuing the previous copy
+            const DeltaBlock *match = nullptr;
+            auto candidates = basis.blocks.find(weak.digest());
+            if (candidates != basis.blocks.end()) {
+                uint32_t strong = crc32c(data + pos, DELTA_BLOCK);
+                for (auto &block : candidates->second) {
+                    if (block.strong != strong) continue;
+                    bool continues = !ops.empty() && ops.back().copy && ops.back().chunk == block.chunk &&
+                                     ops.back().source + ops.back().length == block.offset;
+                    if (!match || continues) match = &block;
+                    if (continues) break;
+                }
+            }
+            if (match) {
+                emit(true, match->chunk, match->offset, DELTA_BLOCK);
+                pos += DELTA_BLOCK;
+                primed = false;
+                continue;
+            }
+            emit(false, 0, pos, 1);
+            if (pos + DELTA_BLOCK < length) weak.roll(bytes[pos], bytes[pos + DELTA_BLOCK]);
+            pos++;
+        }
+        if (pos < length) emit(false, 0, pos, length - pos);
+        return ops;
+    }
+
+    // Build one replica of a new chunk on `nodeId` from ranges of the old replicas
+    // (its own where it has them) and the literal runs. A result that does not
+    // match the new checksums, after a weak and strong checksum collision, is
+    // rewritten from the data.
+    void patchReplica(int nodeId, const ChunkInfo &chunk, const vector<DeltaOp> &ops,
+                      const vector<char> &data, DeltaBasis &basis) {
+        Node &node = nodes[nodeId - 1];
+        fs::path path = node.directory / chunk.object, temp = temporaryPath(node.directory);
+        fs::create_directories(path.parent_path());
+        FileDescriptor out(temp, O_WRONLY | O_CREAT | O_TRUNC);
+        preallocate(out.fd, 0, chunk.objectSize());
+        adviseSequential(out.fd, 0, chunk.objectSize());
+        auto writeLiteral = [&](uint64_t offset, uint64_t length) {
+            ssize_t written = node.io->submit(true, out.fd, (char *)data.data() + offset, length, offset).get();
+            if (written != (ssize_t)length)
+                throw runtime_error("write failed on " + temp.string() + ": " +
+                                    strerror(written < 0 ? -written : EIO));
+        };
+
+        try {
+            uint64_t offset = 0;
+            for (auto &op : ops) {
+                if (!op.copy) {
+                    writeLiteral(op.source, op.length);
+                } else {
+                    auto replica = basis.replicas.find({op.chunk, nodeId});
+                    if (replica == basis.replicas.end()) replica = basis.replicas.lower_bound({op.chunk, 0});
+                    if (replica == basis.replicas.end() || replica->first.first != op.chunk)
+                        throw runtime_error("no replica of the old version is readable");
+                    transferRange(replica->second->fd, op.source, out.fd, offset, op.length,
+                                  nodes[replica->first.second - 1].io.get(), node.io.get());
+                }
+                offset += op.length;
+            }
+
+            vector<char> block(CHECKSUM_BLOCK);
+            for (size_t i = 0; i < chunk.checksums.size(); i++) {
+                size_t length = min<uint64_t>(CHECKSUM_BLOCK, chunk.size - i * CHECKSUM_BLOCK);
+                if (pread(out.fd, block.data(), length, i * CHECKSUM_BLOCK) != (ssize_t)length ||
+                    crc32c(block.data(), length) != chunk.checksums[i]) {
+                    writeLiteral(0, chunk.size);
+                    break;
+                }
+            }
+            node.commits->commit(out.fd, temp, path);
+        } catch (const exception &) {
+            unlink(temp.c_str());
+            throw;
+        }
+    }
+
+    // Re-upload a file as rsync-style deltas against the version already stored:
+    // replicas are patched from their old contents and only literal runs are sent
+    bool uploadDelta(istream &in, uint64_t size, const UploadOptions &options,
+                     const vector<int> &active, const FileInfo &old, UploadResult &result) {
+        DeltaBasis basis;
+        signOldVersion(old, basis);
+        result.delta = true;
+
+        uint64_t fileChunkSize = result.chunkSize;
+        size_t chunkCount = max<uint64_t>(1, (size + fileChunkSize - 1) / fileChunkSize);
+        vector<char> data;
+        for (size_t i = 0; i < chunkCount; i++) {
+            ChunkInfo chunk;
+            chunk.object = result.objectPrefix + "chunk" + to_string(i);
+            uint64_t expected = min(fileChunkSize, size - i * fileChunkSize);
+            data.resize(expected);
+            in.read(data.data(), expected);
+            chunk.size = in.gcount();
+            if (in.bad() || chunk.size != expected) {
+                report("Error during file replication: " +
+                       string(in.bad() ? "read error on upload source" : "source changed during upload"));
+                return false;
+            }
+            for (uint64_t offset = 0; offset < chunk.size; offset += CHECKSUM_BLOCK)
+                chunk.checksums.push_back(crc32c(data.data() + offset, min<uint64_t>(CHECKSUM_BLOCK, chunk.size - offset)));
+
+            vector<DeltaOp> ops = computeDelta(data.data(), chunk.size, basis);
+            for (auto &op : ops) (op.copy ? result.reusedBytes : result.literalBytes) += op.length;
+
+            vector<int> targets = placeChunk(active, i);
+            vector<string> errors(targets.size());
+            runParallel(targets.size(), targets.size(), [&](size_t r) {
+                try {
+                    patchReplica(targets[r], chunk, ops, data, basis);
+                } catch (const exception &e) {
+                    errors[r] = e.what();
+                }
+            });
+            for (size_t r = 0; r < targets.size(); r++) {
+                if (errors[r].empty()) chunk.nodes.push_back(targets[r]);
+                else report("Error during file replication to Node " + to_string(targets[r]) + ": " + errors[r]);
+            }
+            addChunk(result.info, chunk);
+
+            if ((int)chunk.nodes.size() < options.quorum) {
+                report("Error: Only " + to_string(chunk.nodes.size()) + " of " + to_string(options.quorum) +
+                       " required replicas were written.");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Append a small file to the segment store of each target node. The write is
+    // tiny, so every replica is waited for and nothing runs in the background.
+    // Placement starts at a hash of the name, so small files spread over all
+    // active nodes instead of filling the first ones' segments.
+    bool uploadPacked(istream &in, const string &filename, uint64_t size, const UploadOptions &options,
+                      const vector<int> &active, UploadResult &result) {
+        vector<char> data(size);
+        in.read(data.data(), size);
+        if (in.bad() || (uint64_t)in.gcount() != size) {
+            report("Error during file replication: " +
+                   string(in.bad() ? "read error on upload source" : "source changed during upload"));
+            return false;
+        }
+
+        ChunkInfo chunk;
+        chunk.object = result.objectPrefix + "chunk0";
+        chunk.size = size;
+        chunk.packed = true;
+        chunk.codec = options.compression;
+        vector<char> stored;
+        if (!chunk.codec.empty() && size > 0) {
+            stored.resize(FRAME_HEADER + size);
+            stored.resize(encodeFrame(data.data(), size, stored.data(), options.compressionLevel, true));
+            chunk.storedSize = stored.size();
+        } else {
+            stored.swap(data);
+        }
+        if (size > 0) chunk.checksums.push_back(crc32c(stored.data(), stored.size()));
+
+        vector<int> targets = placeChunk(active, hash<string>()(filename) % active.size());
+        vector<string> errors(targets.size());
+        runParallel(targets.size(), targets.size(), [&](size_t r) {
+            Node &node = nodes[targets[r] - 1];
+            try {
+                node.segments->put(chunk.object, stored.data(), stored.size(), *node.commits);
+            } catch (const exception &e) {
+                errors[r] = e.what();
+            }
+        });
+        for (size_t r = 0; r < targets.size(); r++) {
+            if (errors[r].empty()) chunk.nodes.push_back(targets[r]);
+            else report("Error during file replication to Node " + to_string(targets[r]) + ": " + errors[r]);
+        }
+        addChunk(result.info, chunk);
+
+        if ((int)chunk.nodes.size() < options.quorum) {
+            report("Error: Only " + to_string(chunk.nodes.size()) + " of " + to_string(options.quorum) +
+                   " required replicas were written.");
+            return false;
+        }
+        return true;
+    }
+
+    bool uploadFixedChunks(istream &in, const string &filename, uint64_t size,
+                           const UploadOptions &options, const vector<int> &active,
+                           UploadResult &result) {
+        uint64_t fileChunkSize = result.chunkSize;
+        // A stream's length is unknown up front, so its chunks are always numbered
+        bool streaming = (size == UNKNOWN_SIZE);
+        size_t chunkCount = streaming ? 0 : max<uint64_t>(1, (size + fileChunkSize - 1) / fileChunkSize);
+
+        for (size_t i = 0; streaming || i < chunkCount; i++) {
+            ChunkInfo chunk;
+            chunk.object = result.objectPrefix + "chunk" + to_string(i);
+
+            // Stream to all targets concurrently; returns once the quorum is durable
+            uint64_t expected = streaming ? fileChunkSize : min(fileChunkSize, size - i * fileChunkSize);
+            size_t index = result.info.chunks.size();
+            bool stored;
+            if (options.dataShards) {
+                stored = storeChunkErasure(in, chunk,
+                                           placeChunk(active, i, options.dataShards + options.parityShards),
+                                           expected, !streaming, options);
+            } else if (options.zeroCopy) {
+                chunk.size = expected;
+                stored = storeChunkZeroCopy(options.source, i * fileChunkSize, chunk, placeChunk(active, i),
+                                            options.quorum, filename, index, result.methods);
+            } else {
+                stored = storeChunk(in, chunk, placeChunk(active, i), expected, !streaming, options,
+                                    filename, index);
+            }
+            addChunk(result.info, chunk);
+            if (!stored) return false;
+
+            // A stream ends with a short chunk, or right after a full one
+            if (streaming && (chunk.size < fileChunkSize || in.peek() == EOF)) break;
+        }
+        return true;
+    }
+
+    // Cut the source with FastCDC; chunks already stored anywhere are only referenced
+    bool uploadContentDefined(istream &in, const string &filename, const UploadOptions &options,
+                              const vector<int> &active, UploadResult &result) {
+        vector<char> window(CDC_MAX_SIZE * 2);
+        size_t start = 0, end = 0;
+        bool eof = false;
+
+        for (size_t index = 0;; index++) {
+            // Keep at least one maximum-size chunk buffered
+            if (!eof && end - start < CDC_MAX_SIZE) {
+                memmove(window.data(), window.data() + start, end - start);
+                end -= start;
+                start = 0;
+                in.read(window.data() + end, window.size() - end);
+                end += in.gcount();
+                if (in.bad()) {
+                    report("Error: Read error on upload source.");
+                    return false;
+                }
+                eof = in.eof();
+            }
+            if (start == end && index > 0) break;
+
+            size_t length = findCdcBoundary(window.data() + start, end - start);
+            Sha256 sha;
+            sha.update(window.data() + start, length);
+
+            ChunkInfo chunk;
+            // Compressed and raw copies of the same content are different objects
+            chunk.object = string(OBJECTS_DIR) + "/cas/" + sha.hexDigest();
+            if (!options.compression.empty()) chunk.object += "." + options.compression;
+            chunk.size = length;
+
+            CasEntry existing;
+            {
+                lock_guard<mutex> lock(metaMutex);
+                auto entry = casIndex.find(chunk.object);
+                if (entry != casIndex.end()) existing = entry->second;
+            }
+            if (!existing.nodes.empty() && countActive(existing.nodes) >= options.quorum) {
+                chunk.nodes = existing.nodes;
+                chunk.codec = options.compression;
+                chunk.storedSize = existing.storedSize;
+                chunk.checksums = existing.checksums;
+                addChunk(result.info, chunk);
+                result.deduplicated++;
+                result.savedBytes += length;
+            } else {
+                MemoryBuffer buffer(window.data() + start, length);
+                istream chunkIn(&buffer);
+                bool stored = storeChunk(chunkIn, chunk, placeChunk(active, index), length, true,
+                                         options, filename, index);
+                addChunk(result.info, chunk);
+                if (!stored) return false;
+            }
+            start += length;
+        }
+        return true;
+    }
+
+    // Remove every replica of the given chunks
+    void removeChunks(const vector<ChunkInfo> &chunks) {
+        FileInfo stale;
+        stale.chunks = chunks;
+        removeStaleChunks(stale, FileInfo());
+    }
+
+    // Remove replicas of an old version that the new version no longer uses.
+    // Content-addressed objects lose one reference and go away with the last one.
+    void removeStaleChunks(const FileInfo &oldInfo, const FileInfo &newInfo) {
+        for (auto &chunk : oldInfo.chunks) {
+            if (chunk.contentAddressed()) {
+                auto entry = casIndex.find(chunk.object);
+                if (entry == casIndex.end() || --entry->second.refs > 0) continue;
+                for (int nodeID : entry->second.nodes) pins->remove(nodes[nodeID - 1].directory / chunk.object);
+                casIndex.erase(entry);
+                continue;
+            }
+
+            for (size_t slot = 0; slot < chunk.nodes.size(); slot++) {
+                int nodeID = chunk.nodes[slot];
+                string object = chunk.objectOn(slot);
+                bool reused = false;
+                for (auto &current : newInfo.chunks)
+                    for (size_t other = 0; other < current.nodes.size(); other++)
+                        if (current.nodes[other] == nodeID && current.objectOn(other) == object &&
+                            current.packed == chunk.packed)
+                            reused = true;
+                if (reused) continue;
+                if (chunk.packed) {
+                    try {
+                        nodes[nodeID - 1].segments->remove(object);
+                    } catch (const exception &) {
+                        // Left in the segment, unreferenced, like a file that could not be removed
+                    }
+                } else {
+                    fs::path path = nodes[nodeID - 1].directory / object;
+                    pins->remove(path);
+                    // The file's object directory goes with its last object
+                    error_code ec;
+                    if (object.rfind(string(OBJECTS_DIR) + "/files/", 0) == 0) fs::remove(path.parent_path(), ec);
+                }
+            }
+        }
+    }
+
+    // Lowest number of active replicas over all chunks of a file
+    int activeReplicaCount(const FileInfo &info) {
+        int lowest = REPLICATION;
+        for (auto &chunk : info.chunks) {
+            // An erasure-coded chunk counts as one copy plus the shard losses it survives
+            int active = countActive(chunk.nodes);
+            lowest = min(lowest, chunk.erasureCoded() ? active - chunk.dataShards + 1 : active);
+        }
+        return lowest;
+    }
+
+    // Whether re-replication has work to do: a replicated chunk with fewer than
+    // REPLICATION active replicas, or an erasure-coded chunk with a shard on an
+    // inactive node. EC chunks are not compared with the replica count, which a
+    // layout with fewer than two parity shards never reaches.
+    bool needsRepair(const FileInfo &info) {
+        for (auto &chunk : info.chunks) {
+            int active = countActive(chunk.nodes);
+            if (chunk.erasureCoded() ? active < chunk.dataShards + chunk.parityShards : active < REPLICATION)
+                return true;
+        }
+        return false;
+    }
+
+    // Load metadata from file (plain "name:nodes," lines are whole-file entries)
+    void loadMetadata() {
+        try {
+            if (!fs::exists(METADATA_FILE)) return;
+
+            ifstream file(METADATA_FILE);
+            string line, current;
+            map<string, vector<int>> headerNodes;
+            while (getline(file, line)) {
+                if (line.empty()) continue;
+
+                // Tab-indented lines describe chunks of the previous file
+                if (line[0] == '\t') {
+                    if (current.empty()) continue;
+
+                    ChunkInfo chunk;
+                    stringstream fields(line.substr(1));
+                    string field;
+                    getline(fields, field, '\t');
+                    if (field != "chunk") continue;
+                    while (getline(fields, field, '\t')) {
+                        size_t eq = field.find('=');
+                        if (eq == string::npos) continue;
+                        readChunkField(field.substr(0, eq), field.substr(eq + 1), chunk);
+                    }
+                    metadata[current].chunks.push_back(chunk);
+                    metadata[current].size += chunk.size;
+                    continue;
+                }
+
+                size_t colonPos = line.find(':');
+                if (colonPos == string::npos) continue;
+
+                string filename = line.substr(0, colonPos);
+                string nodeStr = line.substr(colonPos + 1);
+
+                vector<int> nodeList = parseNodeList(nodeStr);
+
+                if (!nodeList.empty()) {
+                    metadata[filename] = FileInfo();
+                    headerNodes[filename] = nodeList;
+                    current = filename;
+                }
+            }
+            file.close();
+
+            // Entries without chunk lines are single whole-file objects
+            for (auto &entry : headerNodes) {
+                FileInfo &info = metadata[entry.first];
+                if (!info.chunks.empty()) continue;
+
+                ChunkInfo chunk;
+                chunk.object = entry.first;
+                chunk.nodes = entry.second;
+                for (int id : chunk.nodes) {
+                    error_code ec;
+                    uintmax_t size = fs::file_size(nodes[id - 1].directory / chunk.object, ec);
+                    if (!ec) {
+                        chunk.size = size;
+                        break;
+                    }
+                }
+                info.chunks.push_back(chunk);
+                info.size = chunk.size;
+            }
+
+            // Objects named after files before upload names were checked may
+            // resolve outside the node directories; they are never read or removed
+            for (auto entry = metadata.begin(); entry != metadata.end();) {
+                bool escapes = false;
+                for (auto &chunk : entry->second.chunks) {
+                    fs::path object(chunk.object);
+                    escapes = escapes || object.is_absolute() || find(object.begin(), object.end(), "..") != object.end();
+                }
+                if (!escapes) {
+                    ++entry;
+                    continue;
+                }
+                cout << "[SYSTEM] Ignoring '" << entry->first << "': it names objects outside the node directories.\n";
+                entry = metadata.erase(entry);
+            }
+
+            // Count references to shared content-addressed objects
+            for (auto &entry : metadata) {
+                for (auto &chunk : entry.second.chunks) {
+                    if (!chunk.contentAddressed()) continue;
+                    CasEntry &cas = casIndex[chunk.object];
+                    cas.refs++;
+                    cas.storedSize = chunk.storedSize;
+                    cas.checksums = chunk.checksums;
+                    if (cas.nodes.empty()) cas.nodes = chunk.nodes;
+                }
+            }
+            cout << "[SYSTEM] Metadata loaded from disk.\n\n";
+        } catch (const exception &e) {
+            cout << "Warning: Failed to load metadata: " << e.what() << "\n";
+        }
+    }
+
+    // Parse "1,2,3," into node IDs, ignoring IDs outside the cluster
+    vector<int> parseNodeList(const string &text) {
+        vector<int> nodeList;
+        stringstream ss(text);
+        string token;
+        while (getline(ss, token, ',')) {
+            if (!token.empty()) {
+                int id = stoi(token);
+                if (id >= 1 && id <= (int)nodes.size())
+                    nodeList.push_back(id);
+            }
+        }
+        return nodeList;
+    }
+
+    // Restore one chunk's replication factor; returns log lines
+    vector<string> reReplicateChunk(const string &filename, ChunkInfo &chunk, const string &label) {
+        if (chunk.erasureCoded()) return repairErasureChunk(filename, chunk, label);
+
+        vector<string> log;
+        vector<int> &currentNodes = chunk.nodes;
+        int activeReplicas = 0;
+
+        // Count active replicas
+        for (int id : currentNodes) {
+            if (nodes[id - 1].active)
+                activeReplicas++;
+        }
+
+        if (activeReplicas >= REPLICATION) return log; // Already replicated enough
+
+        // Active replicas to copy from, in order; one that fails verification is dropped
+        vector<int> sources;
+        for (int id : currentNodes)
+            if (nodes[id - 1].active) sources.push_back(id);
+
+        if (sources.empty()) return log; // No active replica to copy from
+
+        auto restore = [&](int targetId) {
+            Node &target = nodes[targetId - 1];
+            string error = "no active replica";
+            for (size_t next = 0; next < sources.size();) {
+                Node &source = nodes[sources[next] - 1];
+                try {
+                    if (chunk.codec.empty() && !chunk.packed) {
+                        fs::path path = target.directory / chunk.object, temp = temporaryPath(target.directory);
+                        fs::create_directories(path.parent_path());
+                        FileDescriptor in(source.directory / chunk.object, O_RDONLY);
+                        if (in.size() != chunk.size)
+                            throw runtime_error("replica is " + to_string(in.size()) + " bytes, expected " +
+                                                to_string(chunk.size));
+                        FileDescriptor out(temp, O_RDWR | O_CREAT | O_TRUNC);
+                        try {
+                            TransferMethod method = transferRange(in.fd, 0, out.fd, 0, in.size(), source.io.get(),
+                                                                  target.io.get(), chunk.verify(),
+                                                                  directMode && in.size() >= DIRECT_IO_MIN_SIZE);
+                            target.commits->commit(out.fd, temp, path);
+                            return method;
+                        } catch (const exception &) {
+                            unlink(temp.c_str());
+                            throw;
+                        }
+                    }
+                    vector<char> stored = readReplica(chunk, source);
+                    if (chunk.verify() && chunk.codec.empty())
+                        verifyBlocks(stored.data(), stored.size(), chunk.checksums);
+                    else if (chunk.verify())
+                        verifyFrames(stored, chunk.checksums);
+                    if (chunk.packed)
+                        target.segments->put(chunk.object, stored.data(), stored.size(), *target.commits);
+                    else
+                        writeShard(targetId, chunk.object, (const uint8_t *)stored.data(), stored.size());
+                    return TransferMethod::Buffered;
+                } catch (const ChecksumError &e) {
+                    // A corrupt source is no use for the other targets either
+                    log.push_back("[CORRUPTION] " + chunk.object + " on Node " + to_string(source.id) +
+                                  ": " + e.what() + "; trying another source.");
+                    sources.erase(sources.begin() + next);
+                    error = e.what();
+                } catch (const exception &e) {
+                    log.push_back("[RE-REPLICATION] Copy of " + chunk.object + " from Node " + to_string(source.id) +
+                                  " failed: " + e.what() + "; trying another source.");
+                    error = e.what();
+                    next++;
+                }
+            }
+            throw runtime_error("no replica of " + chunk.object + " could be copied to Node " + to_string(targetId) +
+                                ": " + error);
+        };
+
+        try {
+            // Find inactive nodes in current list and try to restore on them
+            for (int id : currentNodes) {
+                if (!nodes[id - 1].active && activeReplicas < REPLICATION) {
+                    TransferMethod method = restore(id);
+                    activeReplicas++;
+                    log.push_back("RE-REPLICATED: File '" + filename + "'" + label +
+                                  " restored to Node " + to_string(id) +
+                                  " (" + transferMethodName(method) + ").");
+                }
+            }
+
+            // If still below REPLICATION factor, add to new active nodes
+            if (activeReplicas < REPLICATION) {
+                for (auto &node : nodes) {
+                    if (node.active && find(currentNodes.begin(), currentNodes.end(), node.id) == currentNodes.end()) {
+                        TransferMethod method = restore(node.id);
+                        currentNodes.push_back(node.id);
+                        activeReplicas++;
+                        log.push_back("RE-REPLICATED: File '" + filename + "'" + label +
+                                      " added to Node " + to_string(node.id) +
+                                      " (" + transferMethodName(method) + ").");
+                        if (activeReplicas >= REPLICATION) break;
+                    }
+                }
+            }
+        } catch (const exception &e) {
+            log.push_back(string("Error during re-replication: ") + e.what());
+        }
+        return log;
+    }
+
+    // Move a file's data onto the nodes; metadata is left to commitFile()
+    bool storeFile(const string &path, const string &filename, UploadOptions options, UploadResult &result) {
+        if (!fs::exists(path)) {
+            report("Error: File not found" + string(path.empty() ? "" : ": " + path) + ".");
+            return false;
+        }
+
+        ifstream in(path, ios::binary);
+        error_code ec;
+        uint64_t size = fs::file_size(path, ec);
+        if (!in || ec) {
+            report("Error: Cannot open " + path + " for reading.");
+            return false;
+        }
+        options.source = path;
+        return storeStream(in, filename, size, options, result);
+    }
+
+    // Replicate `size` bytes of `in` (UNKNOWN_SIZE: until the stream ends) as `filename`
+    bool storeStream(istream &in, const string &filename, uint64_t size, UploadOptions options,
+                     UploadResult &result) {
+        string invalid = invalidFileName(filename);
+        if (!invalid.empty()) {
+            report("Error: " + invalid);
+            return false;
+        }
+
+        // Only the quorum has to be reachable; missing replicas are repaired later
+        if (!options.quorum) options.quorum = writeQuorum;
+        vector<int> active = activeNodeIds();
+        int shards = options.dataShards + options.parityShards;
+        if ((int)active.size() < (shards ? shards : options.quorum)) {
+            report("Error: Not enough active nodes for " +
+                   (shards ? to_string(shards) + " shards!" : to_string(options.quorum) + " replicas!"));
+            return false;
+        }
+
+        // Replicas still completing for the previous version would overwrite this one
+        waitForBackground(filename, true);
+
+        if (options.compression.empty()) {
+            for (auto &rule : compressionRules) {
+                if (fnmatch(rule.pattern.c_str(), filename.c_str(), 0) != 0) continue;
+                options.compression = rule.codec;
+                options.compressionLevel = rule.level;
+                break;
+            }
+        }
+        // Zero-copy and erasure-coded uploads store the bytes as they are
+        if (options.compression == "none" || options.zeroCopy || options.dataShards)
+            options.compression.clear();
+
+        // A file that starts like an archive or image is stored raw as a whole
+        if (!options.compression.empty() && size != UNKNOWN_SIZE) {
+            char head[16];
+            in.read(head, sizeof(head));
+            bool compressed = looksCompressed(head, in.gcount());
+            in.clear();
+            in.seekg(0);
+            if (compressed) options.compression.clear();
+        }
+
+        result.chunkSize = options.chunkSize ? options.chunkSize : chunkSize;
+
+        // Small files go to the segment stores rather than getting files of their own
+        bool packed = size != UNKNOWN_SIZE && size <= PACKED_FILE_LIMIT && !options.zeroCopy &&
+                      !options.dataShards && options.chunking == ChunkingMode::Fixed;
+
+        // A new version of a stored file only sends what changed
+        FileInfo previous;
+        {
+            lock_guard<mutex> lock(metaMutex);
+            if (metadata.count(filename)) previous = metadata[filename];
+        }
+        bool delta = !packed && deltaApplies(previous, size, options);
+
+        // Objects get names of their own, so the stored version stays intact
+        // and readable until commitFile replaces it
+        bool taken;
+        do {
+            result.objectPrefix = fileObjectDir(filename) + randomToken() + ".";
+            taken = false;
+            for (auto &chunk : previous.chunks) taken = taken || chunk.object.rfind(result.objectPrefix, 0) == 0;
+        } while (taken);
+
+        bool stored;
+        try {
+            stored = (options.chunking == ChunkingMode::ContentDefined)
+                ? uploadContentDefined(in, filename, options, active, result)
+                : packed ? uploadPacked(in, filename, size, options, active, result)
+                : delta ? uploadDelta(in, size, options, active, previous, result)
+                : uploadFixedChunks(in, filename, size, options, active, result);
+        } catch (const exception &e) {
+            report(string("Error during file replication: ") + e.what());
+            stored = false;
+        }
+        if (!stored) {
+            // Drop what this attempt wrote, keeping objects the old version still uses
+            waitForBackground(filename, true);
+            lock_guard<mutex> lock(metaMutex);
+            removeStaleChunks(result.info, metadata.count(filename) ? metadata[filename] : FileInfo());
+        }
+        return stored;
+    }
+
+    // Make an uploaded version current and return the previous one. Its objects
+    // stay on disk until the caller has saved the metadata and calls
+    // retireVersion, so a crash in between never leaves metadata.txt naming
+    // objects that are gone.
+    FileInfo commitFile(const string &filename, const FileInfo &info) {
+        lock_guard<mutex> lock(metaMutex);
+        FileInfo previous;
+        if (metadata.count(filename)) previous = metadata[filename];
+        metadata[filename] = info;
+        blockCache.invalidate(filename);
+        return previous;
+    }
+
+    // Drop what a replaced version no longer shares with the current one
+    void retireVersion(const FileInfo &previous, const FileInfo &current) {
+        lock_guard<mutex> lock(metaMutex);
+        removeStaleChunks(previous, current);
+    }
+
+    // Why `name` cannot be a file name in the DFS, or "" if it can. Names are
+    // relative paths without "." or ".." components, so they never reach outside
+    // the node directories, and have no control characters, which the
+    // line-based metadata cannot hold.
+    static string invalidFileName(const string &name) {
+        if (name.empty()) return "File name is empty.";
+        if (name[0] == '/') return "File name " + name + " is absolute; upload --from=<path> <name> stores it by name.";
+        for (char c : name)
+            if ((unsigned char)c < 0x20 || c == 0x7f) return "File name contains a control character.";
+        for (auto &component : fs::path(name))
+            if (component == "." || component == "..")
+                return "File name " + name + " has a '" + component.string() + "' component.";
+        string top = fs::path(name).begin()->string();
+        if (top == OBJECTS_DIR || top == STAGING_DIR || top == SEGMENTS_DIR)
+            return "File name " + name + " is inside the reserved node directory " + top + ".";
+        return "";
+    }
+
+    // Files named by a batch spec: a directory (recursive), "@listfile" or a glob
+    // pattern, as (local path, DFS name) pairs. Names are relative to the spec's
+    // root: the directory itself, the directory part of a glob before its first
+    // wildcard, or the current directory for a list.
+    vector<pair<string, string>> expandBatch(const string &spec) {
+        vector<string> paths;
+        fs::path root = ".";
+        if (spec[0] == '@') {
+            ifstream list(spec.substr(1));
+            string line;
+            while (getline(list, line)) {
+                line.erase(0, line.find_first_not_of(" \t"));
+                line.erase(line.find_last_not_of(" \t\r") + 1);
+                if (!line.empty()) paths.push_back(line);
+            }
+        } else if (fs::is_directory(spec)) {
+            root = spec;
+            for (auto &entry : fs::recursive_directory_iterator(spec))
+                if (entry.is_regular_file()) paths.push_back(entry.path().string());
+        } else {
+            fs::path literal;
+            for (auto &component : fs::path(spec).parent_path()) {
+                if (component.string().find_first_of("*?[") != string::npos) break;
+                literal /= component;
+            }
+            if (!literal.empty()) root = literal;
+            glob_t matches;
+            if (glob(spec.c_str(), 0, nullptr, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; i++)
+                    if (fs::is_regular_file(matches.gl_pathv[i])) paths.push_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        }
+
+        vector<pair<string, string>> files;
+        for (auto &path : paths) {
+            fs::path normal = fs::path(path).lexically_normal();
+            // A list entry outside the current directory keeps its path, and is rejected as a name
+            fs::path name = spec[0] == '@' ? normal : normal.lexically_relative(fs::path(root).lexically_normal());
+            files.push_back({normal.generic_string(), name.empty() ? normal.generic_string() : name.generic_string()});
+        }
+        sort(files.begin(), files.end());
+        files.erase(unique(files.begin(), files.end()), files.end());
+        return files;
+    }
+
+public:
+    DistributedFS(int totalNodes) : selector(totalNodes) {
+        for (int i = 1; i <= totalNodes; i++)
+            nodes.emplace_back(i);
+
+        configureIo();
+
+        // Index files a crash interrupted before their rename
+        fs::remove_all(STAGING_DIR);
+        fs::create_directory(STAGING_DIR);
+        indexCommits.reset(new CommitQueue());
+
+        cout << "[DFS] Initialized with " << totalNodes << " nodes.\n";
+        loadMetadata();
+        loadUploads();
+    }
+    ~DistributedFS() {
+        // Background writers and hedged reads use the node queues; let them finish
+        waitForBackground("");
+        waitForHedges();
+        applyBackgroundReplicas();
+    }
+
+    // (Re)create every node's I/O queue with the current engine and depth
+    void configureIo() {
+        for (auto &node : nodes)
+            node.io.reset(new IoQueue(ioDepth, useIoUring));
+    }
+
+    // Choose the node I/O engine ("uring" or "sync") and per-node queue depth
+    void setIoEngine(const string &engine, unsigned depth) {
+        if (engine != "uring" && engine != "sync") {
+            cout << "Error: I/O engine must be 'uring' or 'sync'.\n";
+            return;
+        }
+        if (depth < 1 || depth > MAX_IO_DEPTH) {
+            cout << "Error: Queue depth must be between 1 and " << MAX_IO_DEPTH << ".\n";
+            return;
+        }
+        useIoUring = (engine == "uring");
+        ioDepth = depth;
+        waitForBackground("");  // background writers and hedged reads still use the old queues
+        waitForHedges();
+        configureIo();
+        showIoEngine();
+    }
+
+    void showIoEngine() {
+        bool uring = !nodes.empty() && nodes[0].io->usingUring();
+        cout << "[IO] Node queues use " << (uring ? "io_uring" : "blocking pread/pwrite")
+             << ", depth " << (uring ? nodes[0].io->depth() : ioDepth) << " per node";
+        if (useIoUring && !uring) cout << " (io_uring unavailable)";
+        cout << ".\n\n";
+    }
+
+    // Map a file and hold the view until `unmap`; without a name, list held views
+    void mapCommand(const string &filename) {
+        if (filename.empty()) {
+            if (heldViews.empty()) cout << "[MAP] No mapped files.\n\n";
+            for (auto &entry : heldViews)
+                cout << "[MAP] '" << entry.first << "': " << formatSize(entry.second.size()) << "\n";
+            if (!heldViews.empty()) cout << "[MAP] " << pins->pinned() << " replica file(s) pinned.\n\n";
+            return;
+        }
+        try {
+            ReplicaView view = mapFile(filename);
+            vector<int> used = view.sources();
+            sort(used.begin(), used.end());
+            used.erase(unique(used.begin(), used.end()), used.end());
+            cout << "[MAP] '" << filename << "' (" << formatSize(view.size()) << ") mapped read-only";
+            if (!used.empty()) {
+                cout << " from Node" << (used.size() > 1 ? "s" : "");
+                for (int id : used) cout << " " << id;
+            }
+            cout << ", CRC32C " << hex << setw(8) << setfill('0') << crc32c(view.data(), view.size()) << dec
+                 << setfill(' ') << " read in place; pinned until unmap.\n\n";
+            heldViews[filename] = view;
+        } catch (const exception &e) {
+            cout << "Error during map: " << e.what() << "\n";
+        }
+    }
+
+    void unmapCommand(const string &filename) {
+        if (!heldViews.erase(filename)) {
+            cout << "Error: '" << filename << "' is not mapped.\n";
+            return;
+        }
+        cout << "[UNMAP] '" << filename << "' released; " << pins->deferred()
+             << " replica removal(s) still deferred.\n\n";
+    }
+
+    // Show the block cache, resize it ("off" = 0) or drop its contents ("clear")
+    void configureCache(const string &setting) {
+        if (setting == "off") {
+            blockCache.resize(0);
+        } else if (setting == "clear") {
+            blockCache.resize(blockCache.size());
+        } else if (!setting.empty()) {
+            uint64_t size = parseSize(setting);
+            if (size == 0) {
+                cout << "Error: Cache size must be a size such as 512M, 'off' or 'clear'.\n";
+                return;
+            }
+            blockCache.resize(size);
+        }
+        if (blockCache.size() == 0) cout << "[CACHE] Off.\n\n";
+        else cout << "[CACHE] " << blockCache.describe() << ".\n\n";
+    }
+
+    // Hedge download reads slower than the given percentile of recent reads
+    // ("off" disables hedging; no argument shows the setting)
+    void setHedging(const string &setting) {
+        if (setting == "off") {
+            hedgeQuantile = 0;
+        } else if (!setting.empty()) {
+            double percentile = atof(setting.c_str() + (setting[0] == 'p'));
+            if (percentile < 50 || percentile >= 100) {
+                cout << "Error: Hedge percentile must be at least 50 and below 100, or 'off'.\n";
+                return;
+            }
+            hedgeQuantile = percentile / 100;
+        }
+        if (hedgeQuantile == 0) {
+            cout << "[HEDGE] Off: each read waits for its replica.\n\n";
+            return;
+        }
+        double threshold = selector.percentile(hedgeQuantile);
+        cout << "[HEDGE] Range reads and packed or compressed chunk reads slower than the p" << hedgeQuantile * 100
+             << " of recent reads";
+        if (threshold > 0) cout << " (now " << fixed << setprecision(2) << threshold << defaultfloat << " ms/MiB)";
+        else cout << " (not measured yet)";
+        cout << " are also sent to a second replica.\n\n";
+    }
+
+    // Let bulk uploads and re-replication bypass the page cache, so cold data
+    // does not evict the files downloads are serving
+    void setDirectMode(const string &mode) {
+        if (mode == "on" || mode == "off") {
+            waitForBackground("");  // background writers read the setting
+            directMode = (mode == "on");
+        } else if (!mode.empty()) {
+            cout << "Error: Direct I/O mode must be 'on' or 'off'.\n";
+            return;
+        }
+        cout << "[DIRECT I/O] " << (directMode ? "On" : "Off") << ": uploads and re-replication of replicas from "
+             << formatSize(DIRECT_IO_MIN_SIZE) << (directMode ? " bypass" : " go through") << " the page cache.\n\n";
+    }
+
+    // Upload file + replicate each chunk to 3 nodes (one worker thread per replica)
+    void upload(string filename, UploadOptions options = UploadOptions()) {
+        UploadResult result;
+        if (storeFile(filename, filename, options, result)) finishUpload(filename, options, result);
+    }
+
+    // Replicate a stream (stdin, a pipe, an in-process stream) as its bytes arrive,
+    // without staging it in a file first
+    void uploadStream(istream &in, const string &filename, UploadOptions options = UploadOptions()) {
+        if (options.zeroCopy) {
+            cout << "Error: --zero-copy needs a regular file as the source.\n";
+            return;
+        }
+        UploadResult result;
+        if (storeStream(in, filename, UNKNOWN_SIZE, options, result))
+            finishUpload(filename, options, result);
+    }
+
+    void finishUpload(const string &filename, const UploadOptions &options, UploadResult &result) {
+        FileInfo previous = commitFile(filename, result.info);
+        saveMetadata();
+        retireVersion(previous, result.info);
+        FileInfo &info = result.info;
+
+        cout << "[UPLOAD SUCCESS] File replicated to nodes: ";
+        for (int id : info.allNodes()) cout << id << " ";
+        if (options.chunking == ChunkingMode::ContentDefined)
+            cout << "(" << info.chunks.size() << " content-defined chunks, " << result.deduplicated
+                 << " deduplicated, " << formatSize(result.savedBytes) << " not rewritten) ";
+        else if (info.chunks.size() > 1)
+            cout << "(" << info.chunks.size() << " chunks of " << formatSize(result.chunkSize) << ") ";
+        else if (info.chunks[0].packed)
+            cout << "(packed) ";
+        if (info.storedSize() < info.size)
+            cout << "(compressed " << formatSize(info.size) << " to " << formatSize(info.storedSize()) << ") ";
+        if (options.mode == ReplicationMode::Chain) cout << "(chain)";
+        if (options.dataShards)
+            cout << "(RS " << options.dataShards << "+" << options.parityShards << ", "
+                 << gfKernel().name << ")";
+        if (options.zeroCopy) cout << "(via " << describeMethods(result.methods) << ")";
+        if (result.delta)
+            cout << "(delta: sent " << formatSize(result.literalBytes) << ", reused "
+                 << formatSize(result.reusedBytes) << " from the stored version)";
+        cout << "\n\n";
+
+        if (needsRepair(info))
+            reReplicateFile(filename);
+    }
+
+    // Upload many files in parallel and write metadata once for the whole batch
+    void uploadBatch(string spec, UploadOptions options = UploadOptions()) {
+        vector<pair<string, string>> files = expandBatch(spec);
+        if (files.empty()) {
+            cout << "Error: No files match " << spec << ".\n";
+            return;
+        }
+
+        vector<UploadResult> results(files.size());
+        vector<char> stored(files.size(), false);
+        runParallel(files.size(), BATCH_WORKERS, [&](size_t i) {
+            stored[i] = storeFile(files[i].first, files[i].second, options, results[i]);
+        });
+
+        size_t uploaded = 0;
+        uint64_t bytes = 0;
+        vector<FileInfo> previous(files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            if (!stored[i]) {
+                cout << "[BATCH] Skipped " << files[i].first << ".\n";
+                continue;
+            }
+            previous[i] = commitFile(files[i].second, results[i].info);
+            uploaded++;
+            bytes += results[i].info.size;
+        }
+
+        // One metadata write for the whole batch, before any replaced object goes
+        if (uploaded > 0) saveMetadata();
+        for (size_t i = 0; i < files.size(); i++)
+            if (stored[i]) retireVersion(previous[i], results[i].info);
+
+        cout << "[BATCH UPLOAD SUCCESS] " << uploaded << " of " << files.size()
+             << " files replicated (" << formatSize(bytes) << ").\n\n";
+
+        for (size_t i = 0; i < files.size(); i++)
+            if (stored[i] && needsRepair(results[i].info))
+                reReplicateFile(files[i].second);
+    }
+
+    // Eight hex digits naming a multi-part upload or one attempt at a part
+    static string randomToken() {
+        static mutex mtx;
+        static mt19937 generator(random_device{}());
+        lock_guard<mutex> lock(mtx);
+        stringstream ss;
+        ss << hex << setw(8) << setfill('0') << generator();
+        return ss.str();
+    }
+
+    // Begin a multi-part upload of `filename`; returns its ID, or "" if the name is invalid
+    string startMultipart(const string &filename) {
+        string invalid = invalidFileName(filename);
+        if (!invalid.empty()) {
+            report("Error: " + invalid);
+            return "";
+        }
+        lock_guard<mutex> lock(multipartMutex);
+        string id = randomToken();
+        multipartUploads[id].filename = filename;
+        saveUploads();
+        return id;
+    }
+
+    // Replicate part `number` of an upload from `in` (exactly `size` bytes).
+    // Parts may arrive in any order and in parallel; each one is saved as soon
+    // as every replica is durable, so an interrupted upload keeps it. Sending a
+    // part again replaces it.
+    bool putPart(const string &id, int number, istream &in, uint64_t size) {
+        string filename;
+        {
+            lock_guard<mutex> lock(multipartMutex);
+            auto upload = multipartUploads.find(id);
+            if (upload == multipartUploads.end()) {
+                report("Error: No multi-part upload " + id + ".");
+                return false;
+            }
+            filename = upload->second.filename;
+        }
+        if (number < 1 || number > MAX_PARTS || size > MAX_CHUNK_SIZE) {
+            report("Error: Parts are numbered 1 to " + to_string(MAX_PARTS) + " and hold at most " +
+                   formatSize(MAX_CHUNK_SIZE) + ".");
+            return false;
+        }
+        vector<int> active = activeNodeIds();
+        if ((int)active.size() < writeQuorum) {
+            report("Error: Not enough active nodes for " + to_string(writeQuorum) + " replicas!");
+            return false;
+        }
+
+        // Every attempt gets its own objects, so a failed one cannot damage the part it replaces
+        ChunkInfo chunk;
+        chunk.object = fileObjectDir(filename) + "part" + to_string(number) + "-" + randomToken();
+        vector<int> targets = placeChunk(active, number - 1);
+        UploadOptions options;
+        options.quorum = targets.size();  // nothing is left completing in the background
+        bool stored;
+        try {
+            stored = storeChunk(in, chunk, targets, size, true, options, filename, 0);
+        } catch (const exception &e) {
+            report(string("Error during file replication: ") + e.what());
+            stored = false;
+        }
 
-    Node(int id) {
-        this->id = id;
-        this->active = true;
-        this->directory = "node_" + to_string(id);
+        ChunkInfo replaced;
+        {
+            lock_guard<mutex> lock(multipartMutex);
+            auto upload = multipartUploads.find(id);
+            if (stored && upload == multipartUploads.end()) {
+                report("Error: Multi-part upload " + id + " was aborted meanwhile.");
+                stored = false;
+            }
+            if (stored) {
+                auto previous = upload->second.parts.find(number);
+                if (previous != upload->second.parts.end()) replaced = previous->second;
+                upload->second.parts[number] = chunk;
+                saveUploads();
+            }
+        }
+        lock_guard<mutex> lock(metaMutex);
+        if (!stored) removeChunks({chunk});
+        else if (!replaced.object.empty()) removeChunks({replaced});
+        return stored;
+    }
 
-        if (!fs::exists(directory))
-            fs::create_directory(directory);
+    bool putPartFromFile(const string &id, int number, const string &path) {
+        ifstream in(path, ios::binary);
+        error_code ec;
+        uint64_t size = fs::file_size(path, ec);
+        if (!in || ec) {
+            report("Error: Cannot open " + path + " for reading.");
+            return false;
+        }
+        return putPart(id, number, in, size);
     }
 
-    void fail() { active = false; }
-    void recover() { active = true; }
-};
+    // Send several parts at once, BATCH_WORKERS at a time
+    void putParts(const string &id, const vector<pair<int, string>> &parts) {
+        vector<char> stored(parts.size(), false);
+        runParallel(parts.size(), BATCH_WORKERS, [&](size_t i) {
+            stored[i] = putPartFromFile(id, parts[i].first, parts[i].second);
+        });
+        for (size_t i = 0; i < parts.size(); i++)
+            if (stored[i]) cout << "[MULTIPART] Part " << parts[i].first << " of upload " << id << " committed.\n";
+        cout << "\n";
+    }
 
-class DistributedFS {
-private:
-    vector<Node> nodes;
+    // Turn the committed parts, in part order, into the file's chunks
+    void completeMultipart(const string &id) {
+        MultipartUpload upload;
+        {
+            lock_guard<mutex> lock(multipartMutex);
+            auto entry = multipartUploads.find(id);
+            if (entry == multipartUploads.end() || entry->second.parts.empty()) {
+                cout << "Error: " << (entry == multipartUploads.end() ? "No multi-part upload " + id
+                                                                      : "Upload " + id + " has no parts")
+                     << ".\n";
+                return;
+            }
+            upload = entry->second;
+        }
+        waitForBackground(upload.filename, true);
 
-    // metadata: filename → node IDs storing it
-    map<string, vector<int>> metadata;
+        FileInfo info;
+        for (auto &part : upload.parts) addChunk(info, part.second);
+        FileInfo previous = commitFile(upload.filename, info);
+        saveMetadata();
+        retireVersion(previous, info);
+        {
+            // Only forgotten once the file is saved: a crash in between can complete it again
+            lock_guard<mutex> lock(multipartMutex);
+            multipartUploads.erase(id);
+            saveUploads();
+        }
 
-    const int REPLICATION = 3;
-    const string METADATA_FILE = "metadata.txt";
+        cout << "[UPLOAD SUCCESS] File assembled from " << upload.parts.size() << " parts ("
+             << formatSize(info.size) << ") on nodes: ";
+        for (int nodeId : info.allNodes()) cout << nodeId << " ";
+        cout << "\n\n";
+        if (needsRepair(info)) reReplicateFile(upload.filename);
+    }
 
-    // Save metadata to file
-    void saveMetadata() {
-        try {
-            ofstream file(METADATA_FILE);
-            for (auto &entry : metadata) {
-                file << entry.first << ":";
-                for (int id : entry.second) {
-                    file << id << ",";
-                }
-                file << "\n";
+    void abortMultipart(const string &id) {
+        MultipartUpload upload;
+        {
+            lock_guard<mutex> lock(multipartMutex);
+            auto entry = multipartUploads.find(id);
+            if (entry == multipartUploads.end()) {
+                cout << "Error: No multi-part upload " << id << ".\n";
+                return;
             }
-            file.close();
-        } catch (const exception &e) {
-            cout << "Warning: Failed to save metadata: " << e.what() << "\n";
+            upload = entry->second;
+            multipartUploads.erase(entry);
+            saveUploads();
+        }
+        vector<ChunkInfo> parts;
+        for (auto &part : upload.parts) parts.push_back(part.second);
+        {
+            lock_guard<mutex> lock(metaMutex);
+            removeChunks(parts);
         }
+        cout << "[MULTIPART] Upload " << id << " of '" << upload.filename << "' aborted; "
+             << parts.size() << " parts removed.\n\n";
     }
 
-    // Load metadata from file
-    void loadMetadata() {
-        try {
-            if (!fs::exists(METADATA_FILE)) return;
-
-            ifstream file(METADATA_FILE);
-            string line;
-            while (getline(file, line)) {
-                if (line.empty()) continue;
-
-                size_t colonPos = line.find(':');
-                if (colonPos == string::npos) continue;
+    void listMultipart() {
+        lock_guard<mutex> lock(multipartMutex);
+        if (multipartUploads.empty()) {
+            cout << "No multi-part uploads in progress.\n\n";
+            return;
+        }
+        cout << "\nMULTI-PART UPLOADS:\n";
+        for (auto &entry : multipartUploads) {
+            uint64_t bytes = 0;
+            for (auto &part : entry.second.parts) bytes += part.second.size;
+            cout << " - " << entry.first << " → " << entry.second.filename << " ("
+                 << entry.second.parts.size() << " parts, " << formatSize(bytes) << ")";
+            // Committed part numbers as ranges, e.g. 1-4,7
+            const char *separator = ": ";
+            for (auto it = entry.second.parts.begin(); it != entry.second.parts.end();) {
+                int first = it->first, last = first;
+                while (++it != entry.second.parts.end() && it->first == last + 1) last++;
+                cout << separator << first;
+                if (last > first) cout << "-" << last;
+                separator = ",";
+            }
+            cout << "\n";
+        }
+        cout << "\n";
+    }
 
-                string filename = line.substr(0, colonPos);
-                string nodeStr = line.substr(colonPos + 1);
+    // Client side of a resumable multi-part upload: split a local file into
+    // parts, keep the parts an interrupted attempt already committed (same size
+    // and checksums), send the others in parallel and complete
+    void sendMultipart(const string &path, uint64_t partSize) {
+        error_code ec;
+        uint64_t size = fs::file_size(path, ec);
+        if (ec || !fs::is_regular_file(path)) {
+            cout << "Error: File not found" << (path.empty() ? "" : ": " + path) << ".\n";
+            return;
+        }
+        int partCount = max<uint64_t>(1, (size + partSize - 1) / partSize);
+        if (partCount > MAX_PARTS) {
+            cout << "Error: " << formatSize(partSize) << " parts would make more than " << MAX_PARTS << ".\n";
+            return;
+        }
 
-                vector<int> nodeList;
-                stringstream ss(nodeStr);
-                string token;
-                while (getline(ss, token, ',')) {
-                    if (!token.empty()) {
-                        nodeList.push_back(stoi(token));
-                    }
+        string id;
+        map<int, ChunkInfo> committed;
+        {
+            lock_guard<mutex> lock(multipartMutex);
+            for (auto &entry : multipartUploads)
+                if (entry.second.filename == path) {
+                    id = entry.first;
+                    committed = entry.second.parts;
+                    break;
                 }
+        }
+        if (id.empty()) id = startMultipart(path);
+        if (id.empty()) return;
 
-                if (!nodeList.empty()) {
-                    metadata[filename] = nodeList;
+        // Compare committed parts with the local file; stale ones are dropped or resent
+        vector<int> missing;
+        vector<ChunkInfo> stale;
+        ifstream local(path, ios::binary);
+        vector<char> block(CHECKSUM_BLOCK);
+        for (int number = 1; number <= partCount; number++) {
+            uint64_t offset = (number - 1) * partSize, length = min(partSize, size - offset);
+            auto part = committed.find(number);
+            bool same = part != committed.end() && part->second.size == length &&
+                        part->second.checksums.size() == (length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK;
+            local.seekg(offset);
+            for (size_t i = 0; same && i < part->second.checksums.size(); i++) {
+                size_t n = min<uint64_t>(CHECKSUM_BLOCK, length - i * CHECKSUM_BLOCK);
+                local.read(block.data(), n);
+                same = (size_t)local.gcount() == n && crc32c(block.data(), n) == part->second.checksums[i];
+            }
+            if (!same) missing.push_back(number);
+        }
+        {
+            lock_guard<mutex> lock(multipartMutex);
+            auto upload = multipartUploads.find(id);
+            if (upload != multipartUploads.end()) {
+                for (auto it = upload->second.parts.begin(); it != upload->second.parts.end();) {
+                    if (it->first > partCount) {
+                        stale.push_back(it->second);
+                        it = upload->second.parts.erase(it);
+                    } else {
+                        ++it;
+                    }
                 }
+                if (!stale.empty()) saveUploads();
             }
-            file.close();
-            cout << "[SYSTEM] Metadata loaded from disk.\n\n";
-        } catch (const exception &e) {
-            cout << "Warning: Failed to load metadata: " << e.what() << "\n";
         }
-    }
-
-public:
-    DistributedFS(int totalNodes) {
-        for (int i = 1; i <= totalNodes; i++)
-            nodes.emplace_back(i);
+        if (!stale.empty()) {
+            lock_guard<mutex> lock(metaMutex);
+            removeChunks(stale);
+        }
+        if ((int)missing.size() < partCount)
+            cout << "[MULTIPART] Resuming upload " << id << ": " << partCount - missing.size() << " of "
+                 << partCount << " parts already committed.\n";
 
-        cout << "[DFS] Initialized with " << totalNodes << " nodes.\n";
-        loadMetadata();
+        vector<char> stored(missing.size(), false);
+        runParallel(missing.size(), BATCH_WORKERS, [&](size_t i) {
+            uint64_t offset = (missing[i] - 1) * partSize;
+            ifstream in(path, ios::binary);
+            in.seekg(offset);
+            stored[i] = in && putPart(id, missing[i], in, min(partSize, size - offset));
+        });
+        size_t failed = count(stored.begin(), stored.end(), false);
+        if (failed > 0) {
+            cout << "[MULTIPART] " << failed << " of " << partCount << " parts failed; run the command again to resume upload "
+                 << id << ".\n\n";
+            return;
+        }
+        completeMultipart(id);
     }
 
-    // Upload file + replicate to 3 nodes
-    void upload(string filename) {
-        if (!fs::exists(filename)) {
-            cout << "Error: File not found.\n";
+    // Set how many replicas must succeed before an upload is accepted
+    void setWriteQuorum(int quorum) {
+        if (quorum < 1 || quorum > REPLICATION) {
+            cout << "Error: Quorum must be between 1 and " << REPLICATION << ".\n";
             return;
         }
+        writeQuorum = quorum;
+        cout << "[QUORUM] Uploads return once " << quorum
+             << " replicas are durable; the rest complete in the background.\n\n";
+    }
 
-        vector<int> usedNodes;
-        int replicated = 0;
+    // Fold finished background replicas into the metadata. Runs on the command
+    // thread, between commands, so metadata is never changed under a reader.
+    void applyBackgroundReplicas() {
+        vector<shared_ptr<BackgroundReplica>> finished;
+        {
+            lock_guard<mutex> lock(backgroundMutex);
+            auto split = stable_partition(background.begin(), background.end(),
+                                          [](const shared_ptr<BackgroundReplica> &job) { return !job->done; });
+            finished.assign(split, background.end());
+            background.erase(split, background.end());
+        }
 
-        try {
-            for (auto &node : nodes) {
-                if (node.active) {
-                    fs::copy(filename, node.directory / filename,
-                             fs::copy_options::overwrite_existing);
+        bool changed = false;
+        vector<string> repair;
+        for (auto &job : finished) {
+            auto entry = metadata.find(job->filename);
+            if (job->discarded || entry == metadata.end() ||
+                job->chunkIndex >= entry->second.chunks.size() ||
+                entry->second.chunks[job->chunkIndex].object != job->object)
+                continue;
 
-                    usedNodes.push_back(node.id);
-                    replicated++;
-                }
-                if (replicated == REPLICATION)
-                    break;
+            ChunkInfo &chunk = entry->second.chunks[job->chunkIndex];
+            string label = (entry->second.chunks.size() > 1) ? " chunk " + to_string(job->chunkIndex) : "";
+            if (!job->error.empty()) {
+                cout << "[BACKGROUND] Replica of '" << job->filename << "'" << label << " on Node "
+                     << job->nodeId << " failed: " << job->error << "\n";
+                const vector<int> &keep = chunk.contentAddressed() ? casIndex[chunk.object].nodes : chunk.nodes;
+                if (find(keep.begin(), keep.end(), job->nodeId) == keep.end())
+                    pins->remove(nodes[job->nodeId - 1].directory / job->object);
+                repair.push_back(job->filename);
+                continue;
             }
-        } catch (const fs::filesystem_error &e) {
-            cout << "Error during file replication: " << e.what() << "\n";
-            return;
+            if (find(chunk.nodes.begin(), chunk.nodes.end(), job->nodeId) == chunk.nodes.end()) {
+                chunk.nodes.push_back(job->nodeId);
+                if (chunk.contentAddressed()) shareCasReplicas(chunk);
+                changed = true;
+            }
+            cout << "[BACKGROUND] Replica of '" << job->filename << "'" << label
+                 << " completed on Node " << job->nodeId << ".\n";
         }
 
-        if (replicated < REPLICATION) {
-            cout << "Error: Not enough active nodes for 3 replicas!\n";
-            return;
+        if (changed) saveMetadata();
+
+        sort(repair.begin(), repair.end());
+        repair.erase(unique(repair.begin(), repair.end()), repair.end());
+        for (auto &filename : repair) reReplicateFile(filename);
+    }
+    void showPending() {
+        lock_guard<mutex> lock(backgroundMutex);
+        size_t running = 0;
+        for (auto &job : background) {
+            if (job->done) continue;
+            cout << "[PENDING] " << job->object << " -> Node " << job->nodeId << " ("
+                 << formatSize(job->size) << ")\n";
+            running++;
         }
+        if (running == 0) cout << "No replicas pending.\n";
+        cout << "\n";
+    }
 
-        metadata[filename] = usedNodes;
+    uint64_t getChunkSize() const { return chunkSize; }
 
-        cout << "[UPLOAD SUCCESS] File replicated to nodes: ";
-        for (int id : usedNodes) cout << id << " ";
-        cout << "\n\n";
-        
-        saveMetadata();
+    // Set the default chunk size for new uploads
+    void setChunkSize(uint64_t size) {
+        if (size < MIN_CHUNK_SIZE || size > MAX_CHUNK_SIZE) {
+            cout << "Error: Chunk size must be between " << formatSize(MIN_CHUNK_SIZE)
+                 << " and " << formatSize(MAX_CHUNK_SIZE) << ".\n";
+            return;
+        }
+        chunkSize = size;
+        cout << "[CHUNK SIZE] New uploads are split into " << formatSize(size) << " chunks.\n\n";
+    }
+
+    // Compress uploads of matching files unless the upload chooses itself
+    void setCompressionRule(const string &pattern, const string &spec) {
+        CompressionRule rule{pattern, "", 1};
+        if (!parseCompression(spec, rule.codec, rule.level)) {
+            cout << "Error: Compression must be none or lz4[:1-" << LZ4_MAX_LEVEL << "].\n";
+            return;
+        }
+        auto existing = find_if(compressionRules.begin(), compressionRules.end(),
+                                [&](const CompressionRule &r) { return r.pattern == pattern; });
+        if (existing != compressionRules.end()) *existing = rule;
+        else compressionRules.push_back(rule);
+        cout << "[COMPRESSION] Files matching " << pattern << " are stored " << spec << ".\n\n";
+    }
+    void showCompressionRules() {
+        if (compressionRules.empty()) cout << "No compression rules; uploads are stored raw.\n";
+        for (auto &rule : compressionRules) {
+            cout << " - " << rule.pattern << " → " << rule.codec;
+            if (rule.codec != "none") cout << ":" << rule.level;
+            cout << "\n";
+        }
+        cout << "\n";
     }
 
-    // Download from any active node
+    // Download from any active node, fetching chunks in parallel
     void download(string filename) {
         if (!metadata.count(filename)) {
             cout << "Error: File not found in DFS.\n";
             return;
         }
 
+        FileInfo &info = metadata[filename];
+        uint64_t generation = blockCache.generation(filename);
+        vector<uint64_t> offsets = info.chunkOffsets();
+        vector<char> decoded(info.chunks.size(), false);
+        string target = "downloaded_" + filename;
+
+        // Work units: stripes of plain replicated chunks, whole chunks otherwise
+        struct Stripe {
+            size_t chunk;
+            uint64_t offset, length;
+            int source = -1;
+            string error;
+            TransferMethod method = TransferMethod::Buffered;
+            bool hedged = false;  // a second replica was asked because the first was slow
+
+            Stripe(size_t chunk, uint64_t offset, uint64_t length) : chunk(chunk), offset(offset), length(length) {}
+        };
+        vector<Stripe> stripes;
+        for (size_t i = 0; i < info.chunks.size(); i++) {
+            const ChunkInfo &chunk = info.chunks[i];
+            bool striped = !chunk.erasureCoded() && !chunk.packed && chunk.codec.empty();
+            uint64_t step = striped ? STRIPE_SIZE : max<uint64_t>(chunk.size, 1);
+            uint64_t offset = 0;
+            do {
+                stripes.emplace_back(i, offset, min(step, chunk.size - offset));
+                offset += step;
+            } while (offset < chunk.size);
+        }
+
         try {
-            for (int nodeID : metadata[filename]) {
+            if (fs::path(target).has_parent_path())
+                fs::create_directories(fs::path(target).parent_path());
+            ofstream(target, ios::binary | ios::trunc).close();
+            fs::resize_file(target, info.size);
+        } catch (const fs::filesystem_error &e) {
+            cout << "Error during download: " << e.what() << "\n";
+            return;
+        }
+
+        runParallel(stripes.size(), STRIPE_WORKERS, [&](size_t s) {
+            Stripe &stripe = stripes[s];
+            size_t i = stripe.chunk;
+            const ChunkInfo &chunk = info.chunks[i];
+            if (chunk.erasureCoded()) {
+                try {
+                    bool rebuilt;
+                    stripe.method = readErasureChunk(chunk, target, offsets[i], rebuilt);
+                    decoded[i] = rebuilt;
+                    for (int nodeID : chunk.nodes)
+                        if (nodes[nodeID - 1].active && stripe.source == -1) stripe.source = nodeID;
+                } catch (const exception &e) {
+                    stripe.error = e.what();
+                }
+                return;
+            }
+
+            // The selector spreads stripes over the replicas by latency and
+            // load; one that fails verification is skipped for the next best
+            vector<int> replicas;
+            for (int nodeID : chunk.nodes)
+                if (nodes[nodeID - 1].active) replicas.push_back(nodeID);
+            // Stripes of plain chunks are copied file to file. Packed and compressed
+            // chunks pass through memory anyway, so they are cached and hedged.
+            bool buffered = chunk.packed || !chunk.codec.empty();
+            if (buffered && (blockCache.size() > 0 || (hedgeQuantile > 0 && replicas.size() > 1))) {
+                try {
+                    bool hedged;
+                    writeStored(chunk, readStored(filename, generation, i, chunk, replicas, stripe.source, hedged),
+                                target, offsets[i]);
+                    if (stripe.source == 0) stripe.method = TransferMethod::Cached;
+                    stripe.hedged = hedged;
+                } catch (const exception &e) {
+                    stripe.source = -1;
+                    if (!replicas.empty()) stripe.error = e.what();
+                }
+                return;
+            }
+            while (!replicas.empty()) {
+                int nodeID = selector.pick(replicas);
+                replicas.erase(find(replicas.begin(), replicas.end(), nodeID));
+                Node &node = nodes[nodeID - 1];
+                auto started = chrono::steady_clock::now();
+                auto elapsed = [&] {
+                    return chrono::duration<double>(chrono::steady_clock::now() - started).count();
+                };
+                try {
+                    if (buffered)
+                        readBufferedChunk(chunk, node, target, offsets[i]);
+                    else
+                        stripe.method = readStripe(chunk, node, target, offsets[i], stripe.offset, stripe.length);
+                    selector.finish(nodeID, stripe.length, elapsed());
+                    stripe.source = nodeID;
+                    stripe.error.clear();
+                } catch (const ChecksumError &e) {
+                    selector.finish(nodeID, 0, elapsed(), true);
+                    report("[CORRUPTION] " + chunk.object + " on Node " + to_string(nodeID) +
+                           ": " + e.what() + ".");
+                    stripe.error = "no replica of " + chunk.object + " passed verification";
+                    continue;
+                } catch (const exception &e) {
+                    selector.finish(nodeID, 0, elapsed(), true);
+                    stripe.error = e.what();
+                }
+                return;
+            }
+        });
+
+        vector<int> used;
+        vector<TransferMethod> methods;
+        for (auto &stripe : stripes) {
+            if (!stripe.error.empty()) {
+                cout << "Error during download: " << stripe.error << "\n";
+                return;
+            }
+            if (stripe.source == -1) {
+                cout << "[ERROR] All replicas are unavailable. File cannot be downloaded.\n";
+                return;
+            }
+            if (stripe.source > 0 && find(used.begin(), used.end(), stripe.source) == used.end())
+                used.push_back(stripe.source);
+            methods.push_back(stripe.method);
+        }
+        sort(used.begin(), used.end());
+
+        if (used.empty()) {
+            cout << "[DOWNLOAD SUCCESS] File downloaded from the block cache\n";
+        } else if (used.size() == 1 && info.chunks.size() == 1) {
+            cout << "[DOWNLOAD SUCCESS] File downloaded from Node " << used[0]
+                 << " (" << describeMethods(methods) << ")\n";
+        } else {
+            cout << "[DOWNLOAD SUCCESS] ";
+            if (info.chunks.size() > 1) cout << info.chunks.size() << " chunks";
+            else cout << "File";
+            if (stripes.size() > info.chunks.size()) cout << " in " << stripes.size() << " stripes";
+            cout << " downloaded from Nodes: ";
+            for (int id : used) cout << id << " ";
+            cout << "(" << describeMethods(methods) << ")\n";
+        }
+
+        size_t hedged = count_if(stripes.begin(), stripes.end(), [](const Stripe &stripe) { return stripe.hedged; });
+        if (hedged > 0)
+            cout << "[HEDGED] " << hedged << " of " << stripes.size()
+                 << " reads were slow and also sent to a second replica.\n";
+
+        size_t rebuilt = count(decoded.begin(), decoded.end(), true);
+        if (rebuilt > 0)
+            cout << "[DEGRADED] " << rebuilt << " of " << info.chunks.size()
+                 << " chunks rebuilt from parity shards (" << gfKernel().name << ").\n";
+    }
+
+    // Map a whole file read-only from its replicas instead of copying it out.
+    // Each chunk is mapped from one active replica that passes verification,
+    // back to back in one address range, and the replica files are pinned
+    // against removal while the view lives. Erasure-coded and compressed files
+    // have no replica holding their bytes as-is, and chunks whose boundaries
+    // are not page-aligned (content-defined chunking) cannot be laid out
+    // contiguously; those throw and are read with readRange instead.
+    ReplicaView mapFile(const string &filename) {
+        FileInfo info;
+        uint64_t generation;
+        {
+            lock_guard<mutex> lock(metaMutex);
+            auto entry = metadata.find(filename);
+            if (entry == metadata.end()) throw runtime_error("File not found in DFS.");
+            info = entry->second;
+            generation = blockCache.generation(filename);
+        }
+        for (auto &chunk : info.chunks)
+            if (chunk.erasureCoded() || !chunk.codec.empty())
+                throw runtime_error("only uncompressed, replicated files can be mapped");
+
+        ReplicaView view;
+        view.mapping = make_shared<ReplicaView::Mapping>();
+        view.mapping->pins = pins;
+        view.length = info.size;
+        if (info.size == 0) return view;
+
+        // Reserve the range up front; one extra page leaves room for the first
+        // chunk to start mid-page, as a packed object does in its segment
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        ReplicaView::Mapping &mapping = *view.mapping;
+        mapping.length = (info.size + page - 1) / page * page + page;
+        mapping.base = mmap(nullptr, mapping.length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping.base == MAP_FAILED) throw runtime_error(string("cannot reserve the view: ") + strerror(errno));
+        char *base = (char *)mapping.base;
+
+        vector<uint64_t> offsets = info.chunkOffsets();
+        uint64_t lead = 0;  // bytes before the file's first byte in the range
+        for (size_t i = 0; i < info.chunks.size(); i++) {
+            const ChunkInfo &chunk = info.chunks[i];
+            if (chunk.size == 0) continue;
+            string error = "no active replica";
+            int source = -1;
+            for (int nodeID : chunk.nodes) {
                 Node &node = nodes[nodeID - 1];
+                if (!node.active) continue;
+
+                // Open and pin under the metadata lock, so the replica is the one
+                // this version of the file refers to
+                fs::path path;
+                uint64_t position = 0;
+                unique_ptr<FileDescriptor> in;
+                struct stat st;
+                bool changed = false;
+                try {
+                    lock_guard<mutex> lock(metaMutex);
+                    changed = blockCache.generation(filename) != generation;
+                    if (!changed) {
+                        if (!chunk.packed) path = node.directory / chunk.object;
+                        else if (!node.segments->locate(chunk.object, path, position))
+                            throw runtime_error("object " + chunk.object + " is not in its segments");
+                        in.reset(new FileDescriptor(path, O_RDONLY));
+                        if (fstat(in->fd, &st) != 0) throw runtime_error(string("fstat failed: ") + strerror(errno));
+                        // Segments are append-only, so packed objects need no pin
+                        if (!chunk.packed) pins->pin(path, st.st_ino);
+                    }
+                } catch (const exception &e) {
+                    error = e.what();
+                    continue;
+                }
+                if (changed) throw runtime_error("'" + filename + "' changed while it was being mapped");
+                auto unpin = [&]() {
+                    if (!chunk.packed) pins->unpin(path, st.st_ino);
+                };
 
-                if (node.active) {
-                    fs::copy(node.directory / filename,
-                             "downloaded_" + filename,
-                             fs::copy_options::overwrite_existing);
+                uint64_t phase = position % page;
+                if (source == -1 && i == 0) lead = phase;
+                if ((uint64_t)st.st_size < position + chunk.size) {
+                    error = path.string() + " is shorter than the chunk";
+                    unpin();
+                    continue;
+                }
+                if ((lead + offsets[i]) % page != phase ||
+                    (i + 1 < info.chunks.size() && (lead + offsets[i] + chunk.size) % page != 0)) {
+                    unpin();
+                    throw runtime_error("chunk " + to_string(i) + " of '" + filename +
+                                        "' does not start on a page boundary");
+                }
 
-                    cout << "[DOWNLOAD SUCCESS] File downloaded from Node "
-                         << nodeID << "\n";
-                    return;
+                char *at = base + lead + offsets[i];
+                if (mmap(at - phase, phase + chunk.size, PROT_READ, MAP_SHARED | MAP_FIXED, in->fd,
+                         position - phase) == MAP_FAILED) {
+                    error = string("mmap failed: ") + strerror(errno);
+                    unpin();
+                    continue;
                 }
+                try {
+                    if (chunk.verify()) verifyBlocks(at, chunk.size, chunk.checksums);
+                } catch (const ChecksumError &e) {
+                    report("[CORRUPTION] " + chunk.object + " on Node " + to_string(nodeID) + ": " + e.what() + ".");
+                    error = e.what();
+                    unpin();
+                    continue;
+                }
+                if (!chunk.packed) mapping.pinned.push_back({path, st.st_ino});
+                source = nodeID;
+                break;
             }
-        } catch (const fs::filesystem_error &e) {
-            cout << "Error during download: " << e.what() << "\n";
+            if (source == -1) throw runtime_error("no replica of " + chunk.object + " could be mapped: " + error);
+            view.nodes.push_back(source);
+        }
+        view.start = base + lead;
+        return view;
+    }
+
+    // Read `length` bytes of `filename` from `offset` (clipped to the end of the
+    // file) without copying the rest. Only chunks overlapping the range are
+    // touched: plain chunks are read in the checksum blocks around it from the
+    // best replica (hedged like downloads), erasure-coded chunks from the data
+    // shards holding it, packed and compressed chunks whole. `sources` gets the
+    // nodes that served the range.
+    vector<char> readRange(const string &filename, uint64_t offset, uint64_t length, vector<int> &sources) {
+        FileInfo info;
+        uint64_t generation;
+        {
+            lock_guard<mutex> lock(metaMutex);
+            auto entry = metadata.find(filename);
+            if (entry == metadata.end()) throw runtime_error("File not found in DFS.");
+            info = entry->second;
+            generation = blockCache.generation(filename);
+        }
+        uint64_t end = offset + min(length, info.size - min(offset, info.size));
+        vector<uint64_t> offsets = info.chunkOffsets();
+        vector<char> result;
+        result.reserve(end - min(offset, end));
+
+        for (size_t i = 0; i < info.chunks.size(); i++) {
+            const ChunkInfo &chunk = info.chunks[i];
+            if (offsets[i] + chunk.size <= offset || offsets[i] >= end) continue;
+            uint64_t from = max(offset, offsets[i]) - offsets[i], to = min(end, offsets[i] + chunk.size) - offsets[i];
+
+            vector<char> part;
+            int source = -1;
+            if (chunk.erasureCoded()) {
+                part = readErasureRange(chunk, from, to);
+                for (int nodeID : chunk.nodes)
+                    if (nodes[nodeID - 1].active && source == -1) source = nodeID;
+            } else {
+                vector<int> replicas;
+                for (int nodeID : chunk.nodes)
+                    if (nodes[nodeID - 1].active) replicas.push_back(nodeID);
+                bool hedged;
+                if (chunk.codec.empty() && !chunk.packed) {
+                    uint64_t blockFrom = from / CHECKSUM_BLOCK * CHECKSUM_BLOCK;
+                    uint64_t blockTo = min<uint64_t>(chunk.size, (to + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK * CHECKSUM_BLOCK);
+                    part = readBlocks(filename, generation, i, chunk, replicas, blockFrom, blockTo, source, hedged);
+                    part = vector<char>(part.begin() + (from - blockFrom), part.begin() + (to - blockFrom));
+                } else {
+                    part = readStored(filename, generation, i, chunk, replicas, source, hedged);
+                    if (!chunk.codec.empty()) part = expandRange(part, from, to);
+                    else part = vector<char>(part.begin() + from, part.begin() + to);
+                }
+            }
+            result.insert(result.end(), part.begin(), part.end());
+            if (source > 0 && find(sources.begin(), sources.end(), source) == sources.end()) sources.push_back(source);
+        }
+        return result;
+    }
+
+    // CLI: show a byte range as a hex dump. A negative offset counts from the end.
+    void readCommand(const string &filename, int64_t offset, uint64_t length) {
+        uint64_t size;
+        {
+            lock_guard<mutex> lock(metaMutex);
+            auto entry = metadata.find(filename);
+            if (entry == metadata.end()) {
+                cout << "Error: File not found in DFS.\n";
+                return;
+            }
+            size = entry->second.size;
+        }
+        uint64_t start = offset < 0 ? size - min<uint64_t>(size, -offset) : offset;
+
+        vector<char> data;
+        vector<int> sources;
+        try {
+            data = readRange(filename, start, length, sources);
+        } catch (const exception &e) {
+            cout << "Error during read: " << e.what() << "\n";
             return;
         }
+        cout << "[READ] " << data.size() << " bytes at offset " << start << " of '" << filename << "'";
+        if (!sources.empty()) {
+            cout << " from Node" << (sources.size() > 1 ? "s" : "");
+            for (int id : sources) cout << " " << id;
+        } else if (!data.empty()) {
+            cout << " from the block cache";
+        }
+        cout << "\n";
 
-        cout << "[ERROR] All replicas are unavailable. File cannot be downloaded.\n";
+        const size_t shown = min<size_t>(data.size(), READ_DUMP_LIMIT);
+        for (size_t line = 0; line < shown; line += 16) {
+            cout << hex << setw(8) << setfill('0') << start + line << "  ";
+            for (size_t i = line; i < line + 16; i++) {
+                if (i < shown) cout << setw(2) << (int)(unsigned char)data[i] << " ";
+                else cout << "   ";
+            }
+            cout << dec << setfill(' ') << " ";
+            for (size_t i = line; i < min(line + 16, shown); i++)
+                cout << (isprint((unsigned char)data[i]) ? data[i] : '.');
+            cout << "\n";
+        }
+        if (shown < data.size()) cout << "... " << data.size() - shown << " more bytes\n";
+        cout << "\n";
     }
 
     // Delete file from all nodes
@@ -176,19 +5479,24 @@ public:
             cout << "Error: File not found.\n";
             return;
         }
+        waitForBackground(filename, true);
+        size_t deferred = pins->deferred();
 
         try {
-            for (int nodeID : metadata[filename]) {
-                fs::remove(nodes[nodeID - 1].directory / filename);
-            }
+            removeChunks(metadata[filename].chunks);
         } catch (const fs::filesystem_error &e) {
             cout << "Error during deletion: " << e.what() << "\n";
             return;
         }
 
         metadata.erase(filename);
+        blockCache.invalidate(filename);
 
-        cout << "[DELETE SUCCESS] File removed from DFS.\n\n";
+        cout << "[DELETE SUCCESS] File removed from DFS.\n";
+        if (pins->deferred() > deferred)
+            cout << "[PINNED] " << pins->deferred() - deferred
+                 << " replica file(s) stay on disk until the views mapping them are released.\n";
+        cout << "\n";
         
         saveMetadata();
     }
@@ -203,7 +5511,15 @@ public:
         cout << "\nFILES IN DFS:\n";
         for (auto &entry : metadata) {
             cout << " - " << entry.first << " → Nodes: ";
-            for (int nodeID : entry.second) cout << nodeID << " ";
+            for (int nodeID : entry.second.allNodes()) cout << nodeID << " ";
+            if (entry.second.chunks.size() > 1)
+                cout << "(" << entry.second.chunks.size() << " chunks, "
+                     << formatSize(entry.second.size) << ") ";
+            const ChunkInfo &first = entry.second.chunks.front();
+            if (first.erasureCoded())
+                cout << "(RS " << first.dataShards << "+" << first.parityShards << ")";
+            if (entry.second.storedSize() < entry.second.size)
+                cout << "(stored " << formatSize(entry.second.storedSize()) << ")";
             cout << "\n";
         }
         cout << endl;
@@ -240,7 +5556,18 @@ public:
         cout << "\nNODE STATUS:\n";
         for (auto &node : nodes) {
             cout << "Node " << node.id << ": "
-                 << (node.active ? "Active" : "Failed") << "\n";
+                 << (node.active ? "Active" : "Failed");
+            if (node.commits->committedFiles() > 0)
+                cout << " (" << node.commits->committedFiles() << " replicas committed in "
+                     << node.commits->flushBatches() << " flushes)";
+            if (node.segments->segmentCount() > 0)
+                cout << " [" << node.segments->objectCount() << " packed objects, "
+                     << formatSize(node.segments->storedBytes()) << " live in "
+                     << node.segments->segmentCount() << " segments of "
+                     << formatSize(node.segments->usedBytes()) << "]";
+            string reads = selector.describe(node.id);
+            if (!reads.empty()) cout << " {" << reads << "}";
+            cout << "\n";
         }
         cout << endl;
     }
@@ -249,13 +5576,8 @@ public:
     void checkReplicaHealth() {
         for (auto &entry : metadata) {
             string file = entry.first;
-            vector<int> &nodeList = entry.second;
 
-            int activeCount = 0;
-            for (int id : nodeList) {
-                if (nodes[id - 1].active)
-                    activeCount++;
-            }
+            int activeCount = activeReplicaCount(entry.second);
 
             if (activeCount < 2) {
                 cout << "WARNING: File '" << file
@@ -268,80 +5590,136 @@ public:
         }
     }
 
-    // Re-replicate file to restore replication factor
+    // Re-replicate file to restore replication factor, repairing chunks in parallel
     void reReplicateFile(string filename) {
-        if (!metadata.count(filename)) return;
+        // Replicas still completing in the background are not missing
+        if (!metadata.count(filename) || hasBackground(filename)) return;
 
-        vector<int> &currentNodes = metadata[filename];
-        int activeReplicas = 0;
+        FileInfo &info = metadata[filename];
+        vector<vector<string>> logs(info.chunks.size());
 
-        // Count active replicas
-        for (int id : currentNodes) {
-            if (nodes[id - 1].active)
-                activeReplicas++;
-        }
+        // A shared object repeated within the file is only repaired once
+        vector<bool> repeated(info.chunks.size(), false);
+        for (size_t i = 0; i < info.chunks.size(); i++)
+            for (size_t j = 0; j < i && !repeated[i]; j++)
+                repeated[i] = info.chunks[i].contentAddressed() &&
+                              info.chunks[j].object == info.chunks[i].object;
 
-        if (activeReplicas >= REPLICATION) return; // Already replicated enough
+        runParallel(info.chunks.size(), CHUNK_WORKERS, [&](size_t i) {
+            if (repeated[i]) return;
+            string label = (info.chunks.size() > 1) ? " chunk " + to_string(i) : "";
+            logs[i] = reReplicateChunk(filename, info.chunks[i], label);
+        });
 
-        // Find the first active replica to copy from
-        int sourceNodeId = -1;
-        for (int id : currentNodes) {
-            if (nodes[id - 1].active) {
-                sourceNodeId = id;
-                break;
-            }
+        bool changed = false;
+        for (size_t i = 0; i < logs.size(); i++) {
+            for (auto &message : logs[i]) cout << message << "\n";
+            if (!logs[i].empty() && info.chunks[i].contentAddressed())
+                shareCasReplicas(info.chunks[i]);
+            changed = changed || !logs[i].empty();
         }
 
-        if (sourceNodeId == -1) return; // No active replica to copy from
+        if (changed) saveMetadata();
+    }
+};
 
-        try {
-            // Find inactive nodes in current list and try to restore on them
-            for (int id : currentNodes) {
-                if (!nodes[id - 1].active && activeReplicas < REPLICATION) {
-                    fs::copy(nodes[sourceNodeId - 1].directory / filename,
-                             nodes[id - 1].directory / filename,
-                             fs::copy_options::overwrite_existing);
-                    activeReplicas++;
-                    cout << "RE-REPLICATED: File '" << filename << "' restored to Node " << id << ".\n";
-                }
-            }
+// Strip leading "--option" flags from an upload argument
+bool parseUploadOptions(string &arg, UploadOptions &options) {
+    while (arg.rfind("--", 0) == 0) {
+        size_t end = arg.find_first_of(" \t");
+        string flag = arg.substr(0, end);
+        arg = (end == string::npos) ? "" : arg.substr(end);
+        arg.erase(0, arg.find_first_not_of(" \t"));
 
-            // If still below REPLICATION factor, add to new active nodes
-            if (activeReplicas < REPLICATION) {
-                for (auto &node : nodes) {
-                    if (node.active && find(currentNodes.begin(), currentNodes.end(), node.id) == currentNodes.end()) {
-                        fs::copy(nodes[sourceNodeId - 1].directory / filename,
-                                 node.directory / filename,
-                                 fs::copy_options::overwrite_existing);
-                        currentNodes.push_back(node.id);
-                        activeReplicas++;
-                        cout << "RE-REPLICATED: File '" << filename << "' added to Node " << node.id << ".\n";
-                        if (activeReplicas >= REPLICATION) break;
-                    }
-                }
+        if (flag == "--chain") options.mode = ReplicationMode::Chain;
+        else if (flag == "--star") options.mode = ReplicationMode::Star;
+        else if (flag == "--cdc") options.chunking = ChunkingMode::ContentDefined;
+        else if (flag == "--zero-copy") options.zeroCopy = true;
+        else if (flag == "--full") options.delta = false;
+        else if (flag.rfind("--from=", 0) == 0) options.source = flag.substr(7);
+        else if (flag.rfind("--ec=", 0) == 0) {
+            string spec = flag.substr(5);
+            size_t plus = spec.find('+');
+            options.dataShards = (plus == string::npos) ? 0 : atoi(spec.substr(0, plus).c_str());
+            options.parityShards = (plus == string::npos) ? 0 : atoi(spec.c_str() + plus + 1);
+            if (options.dataShards < 1 || options.parityShards < 1 ||
+                options.dataShards + options.parityShards > 255) {
+                cout << "Error: Erasure coding takes --ec=<k>+<m> with k, m >= 1 and k + m <= 255.\n";
+                return false;
             }
-
-            saveMetadata();
-        } catch (const fs::filesystem_error &e) {
-            cout << "Error during re-replication: " << e.what() << "\n";
+        }
+        else if (flag.rfind("--compress=", 0) == 0) {
+            if (!parseCompression(flag.substr(11), options.compression, options.compressionLevel)) {
+                cout << "Error: Compression must be none or lz4[:1-" << LZ4_MAX_LEVEL << "].\n";
+                return false;
+            }
+        }
+        else if (flag.rfind("--quorum=", 0) == 0) {
+            options.quorum = atoi(flag.c_str() + 9);
+            if (options.quorum < 1 || options.quorum > REPLICATION) {
+                cout << "Error: Quorum must be between 1 and " << REPLICATION << ".\n";
+                return false;
+            }
+        }
+        else if (flag.rfind("--chunk-size=", 0) == 0) {
+            options.chunkSize = parseSize(flag.substr(13));
+            if (options.chunkSize < MIN_CHUNK_SIZE || options.chunkSize > MAX_CHUNK_SIZE) {
+                cout << "Error: Chunk size must be between " << formatSize(MIN_CHUNK_SIZE)
+                     << " and " << formatSize(MAX_CHUNK_SIZE) << ".\n";
+                return false;
+            }
+        }
+        else {
+            cout << "Error: Unknown upload option " << flag << ".\n";
+            return false;
         }
     }
-};
 
-int main() {
-    DistributedFS dfs(4); // 4 nodes recommended for triple replication
+    // File-to-file copies skip the read-once pipeline that chain and CDC rely on
+    if (options.zeroCopy && (options.mode == ReplicationMode::Chain ||
+                             options.chunking == ChunkingMode::ContentDefined)) {
+        cout << "Error: --zero-copy cannot be combined with --chain or --cdc.\n";
+        return false;
+    }
+    if (options.dataShards && (options.zeroCopy || options.mode == ReplicationMode::Chain ||
+                               options.chunking == ChunkingMode::ContentDefined)) {
+        cout << "Error: --ec cannot be combined with --chain, --cdc or --zero-copy.\n";
+        return false;
+    }
+    if (options.compression == "lz4" && (options.zeroCopy || options.dataShards)) {
+        cout << "Error: --compress cannot be combined with --zero-copy or --ec.\n";
+        return false;
+    }
+    if (options.zeroCopy && !options.source.empty()) {
+        cout << "Error: --zero-copy cannot be combined with --from.\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    // 4 nodes recommended for triple replication; erasure coding needs k + m
+    int nodeCount = (argc > 1) ? atoi(argv[1]) : 4;
+    if (nodeCount < 1 || nodeCount > 255) {
+        cout << "Usage: dfs [node_count]\n";
+        return 1;
+    }
+    DistributedFS dfs(nodeCount);
 
     string line, cmd, arg;
 
     cout << "\n=== DISTRIBUTED FILE SYSTEM ===\n";
-    cout << "Commands: upload <file>, download <file>, delete <file>, list, fail <id>, recover <id>, nodes, exit\n\n";
+    cout << "Commands: upload [--chain | --zero-copy] [--full] [--chunk-size=<size> | --cdc] [--quorum=<n> | --ec=<k>+<m>] [--compress=<codec>] [--from=<path | ->] <file>, upload-batch [options] <dir | glob | @list>, multipart start|put|complete|abort|list|send, download <file>, read <file> <offset> <length>, map [<file>], unmap <file>, delete <file>, list, fail <id>, recover <id>, nodes, pending, quorum <n>, chunksize <size>, compress [<pattern> <codec>], io [uring|sync] [depth], direct [on|off], hedge [off|<percentile>], cache [<size>|off|clear], exit\n\n";
 
     while (true) {
         cout << "DFS> ";
-        getline(cin, line);
+        if (!getline(cin, line)) break;
 
         if (line.empty()) continue;
 
+        // Record replicas that finished in the background since the last command
+        dfs.applyBackgroundReplicas();
+
         stringstream ss(line);
         ss >> cmd;
 
@@ -349,8 +5727,30 @@ int main() {
             getline(ss, arg);
             // Trim leading whitespace from arg
             arg.erase(0, arg.find_first_not_of(" \t"));
-            if (!arg.empty()) dfs.upload(arg);
-            else cout << "Usage: upload <filename>\n";
+            UploadOptions options;
+            if (!parseUploadOptions(arg, options)) continue;
+            if (arg.empty()) {
+                cout << "Usage: upload [--chain | --zero-copy] [--full] [--chunk-size=<size> | --cdc] [--quorum=<n> | --ec=<k>+<m>] [--compress=<none | lz4[:level]>] [--from=<path | ->] <filename>\n";
+            } else if (options.source == "-") {
+                // The rest of standard input is the file's data
+                dfs.uploadStream(cin, arg, options);
+                break;
+            } else if (!options.source.empty()) {
+                ifstream source(options.source, ios::binary);
+                if (source) dfs.uploadStream(source, arg, options);
+                else cout << "Error: Cannot open " << options.source << " for reading.\n";
+            } else {
+                dfs.upload(arg, options);
+            }
+        }
+        else if (cmd == "upload-batch") {
+            getline(ss, arg);
+            arg.erase(0, arg.find_first_not_of(" \t"));
+            UploadOptions options;
+            if (!parseUploadOptions(arg, options)) continue;
+            if (!options.source.empty()) cout << "Error: --from only applies to upload.\n";
+            else if (!arg.empty()) dfs.uploadBatch(arg, options);
+            else cout << "Usage: upload-batch [options] <directory | glob | @listfile>\n";
         }
         else if (cmd == "download") {
             getline(ss, arg);
@@ -358,6 +5758,37 @@ int main() {
             if (!arg.empty()) dfs.download(arg);
             else cout << "Usage: download <filename>\n";
         }
+        else if (cmd == "read") {
+            // read <file> <offset> <length>: the filename may contain spaces
+            getline(ss, arg);
+            auto takeLastWord = [&]() {
+                arg.erase(arg.find_last_not_of(" \t") + 1);
+                size_t space = arg.find_last_of(" \t");
+                string word = arg.substr(space == string::npos ? 0 : space + 1);
+                arg.erase(space == string::npos ? 0 : space);
+                return word;
+            };
+            string lengthText = takeLastWord(), offsetText = takeLastWord();
+            arg.erase(0, arg.find_first_not_of(" \t"));
+            arg.erase(arg.find_last_not_of(" \t") + 1);
+            try {
+                size_t used;
+                int64_t offset = stoll(offsetText, &used);
+                uint64_t length = parseSize(lengthText);
+                if (arg.empty() || used != offsetText.size() || length == 0) throw invalid_argument("read");
+                dfs.readCommand(arg, offset, length);
+            } catch (const exception &) {
+                cout << "Usage: read <filename> <offset> <length>  (negative offset: from the end)\n";
+            }
+        }
+        else if (cmd == "map" || cmd == "unmap") {
+            arg.clear();
+            getline(ss, arg);
+            arg.erase(0, arg.find_first_not_of(" \t"));
+            if (cmd == "map") dfs.mapCommand(arg);
+            else if (!arg.empty()) dfs.unmapCommand(arg);
+            else cout << "Usage: unmap <filename>\n";
+        }
         else if (cmd == "delete") {
             getline(ss, arg);
             arg.erase(0, arg.find_first_not_of(" \t"));
@@ -368,24 +5799,141 @@ int main() {
             dfs.listFiles();
         }
         else if (cmd == "fail") {
+            arg.clear();
             ss >> arg;
-            if (!arg.empty()) {
-                int nodeId = stoi(arg);
-                dfs.failNode(nodeId);
+            size_t used = 0;
+            int nodeId = 0;
+            try {
+                nodeId = stoi(arg, &used);
+            } catch (const exception &) {
+                used = 0;
             }
+            if (!arg.empty() && used == arg.size()) dfs.failNode(nodeId);
             else cout << "Usage: fail <node_id>\n";
         }
         else if (cmd == "recover") {
+            arg.clear();
             ss >> arg;
-            if (!arg.empty()) {
-                int nodeId = stoi(arg);
-                dfs.recoverNode(nodeId);
+            size_t used = 0;
+            int nodeId = 0;
+            try {
+                nodeId = stoi(arg, &used);
+            } catch (const exception &) {
+                used = 0;
             }
+            if (!arg.empty() && used == arg.size()) dfs.recoverNode(nodeId);
             else cout << "Usage: recover <node_id>\n";
         }
         else if (cmd == "nodes") {
             dfs.showNodes();
         }
+        else if (cmd == "pending") {
+            dfs.showPending();
+        }
+        else if (cmd == "quorum") {
+            arg.clear();
+            ss >> arg;
+            size_t used = 0;
+            int quorum = 0;
+            try {
+                quorum = stoi(arg, &used);
+            } catch (const exception &) {
+                used = 0;
+            }
+            if (!arg.empty() && used == arg.size()) dfs.setWriteQuorum(quorum);
+            else cout << "Usage: quorum <n>\n";
+        }
+        else if (cmd == "io") {
+            string engine, depth;
+            ss >> engine >> depth;
+            size_t used = 0;
+            unsigned long value = DEFAULT_IO_DEPTH;
+            try {
+                if (!depth.empty()) value = stoul(depth, &used);
+            } catch (const exception &) {
+                used = string::npos;
+            }
+            if (engine.empty()) dfs.showIoEngine();
+            else if (!depth.empty() && (used != depth.size() || depth[0] == '-'))
+                cout << "Usage: io [uring|sync] [depth]\n";
+            else dfs.setIoEngine(engine, min<unsigned long>(value, MAX_IO_DEPTH + 1));
+        }
+        else if (cmd == "cache") {
+            string setting;
+            ss >> setting;
+            dfs.configureCache(setting);
+        }
+        else if (cmd == "hedge") {
+            string setting;
+            ss >> setting;
+            dfs.setHedging(setting);
+        }
+        else if (cmd == "direct") {
+            string mode;
+            ss >> mode;
+            dfs.setDirectMode(mode);
+        }
+        else if (cmd == "compress") {
+            string pattern, spec;
+            ss >> pattern >> spec;
+            if (pattern.empty()) dfs.showCompressionRules();
+            else if (!spec.empty()) dfs.setCompressionRule(pattern, spec);
+            else cout << "Usage: compress [<pattern> <none | lz4[:level]>]\n";
+        }
+        else if (cmd == "multipart") {
+            string action;
+            ss >> action;
+            if (action == "start") {
+                getline(ss, arg);
+                arg.erase(0, arg.find_first_not_of(" \t"));
+                string id = arg.empty() ? "" : dfs.startMultipart(arg);
+                if (!id.empty()) cout << "[MULTIPART] Upload " << id << " started for '" << arg << "'.\n\n";
+                else if (arg.empty()) cout << "Usage: multipart start <file>\n";
+            }
+            else if (action == "put") {
+                string id, number, path;
+                vector<pair<int, string>> parts;
+                ss >> id;
+                while (ss >> number >> path) parts.push_back({atoi(number.c_str()), path});
+                if (!parts.empty()) dfs.putParts(id, parts);
+                else cout << "Usage: multipart put <id> <part> <path> [<part> <path> ...]\n";
+            }
+            else if (action == "complete" || action == "abort") {
+                ss >> arg;
+                if (arg.empty()) cout << "Usage: multipart " << action << " <id>\n";
+                else if (action == "complete") dfs.completeMultipart(arg);
+                else dfs.abortMultipart(arg);
+            }
+            else if (action == "list") {
+                dfs.listMultipart();
+            }
+            else if (action == "send") {
+                getline(ss, arg);
+                arg.erase(0, arg.find_first_not_of(" \t"));
+                uint64_t partSize = dfs.getChunkSize();
+                if (arg.rfind("--part-size=", 0) == 0) {
+                    size_t end = arg.find_first_of(" \t");
+                    partSize = parseSize(arg.substr(12, end == string::npos ? string::npos : end - 12));
+                    arg = (end == string::npos) ? "" : arg.substr(end);
+                    arg.erase(0, arg.find_first_not_of(" \t"));
+                }
+                if (partSize < MIN_CHUNK_SIZE || partSize > MAX_CHUNK_SIZE)
+                    cout << "Error: Part size must be between " << formatSize(MIN_CHUNK_SIZE) << " and "
+                         << formatSize(MAX_CHUNK_SIZE) << ".\n";
+                else if (!arg.empty()) dfs.sendMultipart(arg, partSize);
+                else cout << "Usage: multipart send [--part-size=<size>] <file>\n";
+            }
+            else {
+                cout << "Usage: multipart start <file> | put <id> <part> <path> ... | complete <id> | "
+                        "abort <id> | list | send [--part-size=<size>] <file>\n";
+            }
+        }
+        else if (cmd == "chunksize") {
+            arg.clear();
+            ss >> arg;
+            if (!arg.empty()) dfs.setChunkSize(parseSize(arg));
+            else cout << "Usage: chunksize <size>\n";
+        }
         else if (cmd == "exit") {
             break;
         }